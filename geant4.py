@@ -1,6 +1,7 @@
 import json
 import numpy as np
 from muon_slabs import initialize, simulate_muon, collect
+import muon_slabs
 from time import time
 import pickle
 from mag_fields import UniformMagneticField
@@ -18,42 +19,75 @@ def get_design(d:dict):
     }
     return detector
 
-def initialize_geant4(detector, seed=None):
-    B = np.array(detector['global_field_map'].pop('B'))
+def initialize_geant4(detector, seed=None, num_threads=1):
+    B = np.asarray(detector['global_field_map'].pop('B'))
     if seed is None:
         seeds = (np.random.randint(256), np.random.randint(256), np.random.randint(256), np.random.randint(256))
     else:
         seeds = (seed, seed, seed, seed)
-    output_data = initialize(*seeds, json.dumps(detector), B)
+    output_data = initialize(*seeds, json.dumps(detector), B, num_threads)
     return output_data
 
-def simulate_muons(muons):
+def write_bundle(path, detector):
+    """Writes the detector and its field map into one bundle file for initialize_geant4_bundle."""
+    detector = dict(detector, global_field_map=dict(detector['global_field_map']))
+    B = np.asarray(detector['global_field_map'].pop('B'))
+    muon_slabs.write_detector_bundle(path, json.dumps(detector), B)
+
+def initialize_geant4_bundle(path, seed=None, num_threads=1):
+    """Like initialize_geant4, with the field map memory-mapped from a bundle file."""
+    if seed is None:
+        seeds = (np.random.randint(256), np.random.randint(256), np.random.randint(256), np.random.randint(256))
+    else:
+        seeds = (seed, seed, seed, seed)
+    return muon_slabs.initialize_from_bundle(*seeds, path, num_threads)
+
+def reconfigure_geant4(detector):
+    """Swaps in a new detector (geometry and field map) without initializing Geant4 again.
+    Needs a session initialized with num_threads = 1."""
+    B = np.asarray(detector['global_field_map'].pop('B'))
+    return muon_slabs.reconfigure(json.dumps(detector), B)
+
+def simulate_muons(muons, flat=False, num_workers=1):
+    """Runs all muons (rows of x, y, z, px, py, pz, charge) in one Geant4 run.
+    With flat=True returns the columns of all steps and an 'offsets' array, muon i owning
+    steps offsets[i]:offsets[i+1]; otherwise one dict per muon like collect().
+    num_workers > 1 splits the muons over processes forked from the initialized one."""
+    muons = np.asarray(muons, dtype=np.float64)[:, :7]
+    if num_workers > 1:
+        data = muon_slabs.simulate_muons_forked(muons, num_workers)
+    else:
+        data = muon_slabs.simulate_muons(muons)
+    if flat:
+        return data
+    offsets = data.pop('offsets')
+    track_starts = data.pop('track_starts')
+    killed_tracks = data.pop('killed_tracks')
+    bounds = np.searchsorted(track_starts, offsets)
     muon_data = []
-    for muon in muons:
-        x, y, z,px,py,pz, charge = muon[:7]
-        simulate_muon(px, py, pz, int(charge), x, y, z)
-        data = collect()
-        muon_data.append(data)
+    for i in range(len(offsets) - 1):
+        muon = {key: value[offsets[i]:offsets[i + 1]] for key, value in data.items()}
+        muon['track_starts'] = track_starts[bounds[i]:bounds[i + 1]] - offsets[i]
+        muon['killed_tracks'] = killed_tracks[i]
+        muon_data.append(muon)
     return muon_data
 
-def get_field_dict(file_name=None):
+def get_field_dict(file_name=None, interpolation='nearest', storage='soa', symmetry='auto'):
     with open(file_name, 'rb') as f:
         fields = pickle.load(f)
-    points,B = fields['points'], fields['B'].astype(np.float32)
-    d_space = (points[:, 0].max().item(), points[:, 1].max().item(), (points[:, 2].min().item(), points[:, 2].max().item()))
-    resol = (np.diff(np.unique(points[:, 0]))[0].item(), np.diff(np.unique(points[:, 1]))[0].item(), np.diff(np.unique(points[:, 2]))[0].item())
-    return {'B': B,
-            'range_x': [0.,d_space[0], resol[0]],
-            'range_y': [0.,d_space[1], resol[1]],
-            'range_z': [d_space[2][0],d_space[2][1], resol[2]]}
+    # Points may come in any order; the grid and symmetry are worked out while sorting B into place
+    field_map = muon_slabs.ingest_field_map(fields['points'], fields['B'].astype(np.float32), symmetry=symmetry)
+    field_map['interpolation'] = interpolation
+    field_map['storage'] = storage
+    return field_map
 
-def run(data,mag_type:str):
+def run(data,mag_type:str, interpolation:str='nearest'):
     if mag_type == 'toy':
         field_map = {'B': []}
     elif mag_type == 'uniform':
         field_map = {'B': UniformMagneticField.get_magnetic_field(0, 0, 0)}
     else:
-        field_map = get_field_dict(file_name=mag_type)
+        field_map = get_field_dict(file_name=mag_type, interpolation=interpolation)
         
     detector = get_design(field_map)
     detector["store_primary"] = True
@@ -66,6 +66,20 @@ class CustomMagneticField:
 
         return Bfield
 
+class Geant4MagneticField:
+    """The field Geant4 transports with, evaluated by muon_slabs. Call geant4.initialize_geant4 first."""
+    def __init__(self, num_threads=0):
+        from muon_slabs import evaluate_field
+        self.evaluate_field = evaluate_field
+        self.num_threads = num_threads
+
+    def get_magnetic_field(self, x, y, z):
+        return self.evaluate_field(np.array([[x, y, z]], dtype=np.float64), 1)[0]
+
+    def get_magnetic_fields(self, points):
+        """points: (N, 3) array in m, returns (N, 3) array in tesla"""
+        return self.evaluate_field(np.asarray(points, dtype=np.float64), self.num_threads)
+
 class UniformMagneticField:
     @staticmethod
     def get_magnetic_field(x: float, y: float, z: float) -> np.ndarray:
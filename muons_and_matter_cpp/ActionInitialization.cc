@@ -0,0 +1,95 @@
+#include "ActionInitialization.hh"
+
+ActionInitialization::ActionInitialization(bool storeAll, bool storePrimary, bool storeFloat32, size_t stepReserve)
+    : G4VUserActionInitialization(), storeAll(storeAll), storePrimary(storePrimary), storeFloat32(storeFloat32),
+      stepReserve(stepReserve), killMomenta(-1), killSecondary(false), outputWriter(nullptr) {
+}
+
+ActionInitialization::~ActionInitialization() {
+}
+
+void ActionInitialization::BuildForMaster() const {
+    // The master does not process events, it needs no user actions
+}
+
+void ActionInitialization::Build() const {
+    auto steppingAction = new CustomSteppingAction();
+    steppingAction->setStoreAll(storeAll);
+    steppingAction->setStorePrimary(storePrimary);
+    steppingAction->records.setFloat32(storeFloat32);
+    steppingAction->records.setReserveHint(stepReserve);
+    steppingAction->records.reset();
+    auto primariesGenerator = new PrimaryGeneratorAction();
+    primariesGenerator->setSteppingAction(steppingAction);
+    primariesGenerator->setPrimaryQueue(&primaryQueue);
+    auto eventAction = new CustomEventAction();
+    eventAction->setSteppingAction(steppingAction);
+    eventAction->setRecordStore(&recordStore);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        steppingAction->setKillMomenta(killMomenta);
+        steppingAction->setKillSecondary(killSecondary);
+        steppingAction->setScoringPlanes(scoringPlanes);
+        steppingAction->setKillRegions(killRegions);
+        eventAction->setOutputWriter(outputWriter);
+        steppingActions.push_back(steppingAction);
+        eventActions.push_back(eventAction);
+    }
+
+    SetUserAction(primariesGenerator);
+    SetUserAction(steppingAction);
+    SetUserAction(eventAction);
+}
+
+void ActionInitialization::setPrimaries(std::vector<PrimaryGeneratorAction::Primary> primaries) {
+    primaryQueue = std::move(primaries);
+}
+
+void ActionInitialization::clearPrimaries() {
+    primaryQueue.clear();
+}
+
+void ActionInitialization::setKillMomenta(double killMomenta) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ActionInitialization::killMomenta = killMomenta;
+    for (CustomSteppingAction* steppingAction : steppingActions) {
+        steppingAction->setKillMomenta(killMomenta);
+    }
+}
+
+void ActionInitialization::setKillSecondary(bool killSecondary) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ActionInitialization::killSecondary = killSecondary;
+    for (CustomSteppingAction* steppingAction : steppingActions) {
+        steppingAction->setKillSecondary(killSecondary);
+    }
+}
+
+void ActionInitialization::setScoringPlanes(const std::vector<double>& zPlanes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    scoringPlanes = zPlanes;
+    for (CustomSteppingAction* steppingAction : steppingActions) {
+        steppingAction->setScoringPlanes(scoringPlanes);
+    }
+}
+
+void ActionInitialization::setKillRegions(const KillRegions& killRegions) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ActionInitialization::killRegions = killRegions;
+    for (CustomSteppingAction* steppingAction : steppingActions) {
+        steppingAction->setKillRegions(killRegions);
+    }
+}
+
+void ActionInitialization::setOutputWriter(StepFileWriter* outputWriter) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ActionInitialization::outputWriter = outputWriter;
+    for (CustomEventAction* eventAction : eventActions) {
+        eventAction->setOutputWriter(outputWriter);
+    }
+}
+
+EventRecordStore& ActionInitialization::getRecordStore() {
+    return recordStore;
+}
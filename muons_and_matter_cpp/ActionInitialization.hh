@@ -0,0 +1,57 @@
+#ifndef ACTIONINITIALIZATION_HH
+#define ACTIONINITIALIZATION_HH
+
+#include <mutex>
+#include <vector>
+#include "G4VUserActionInitialization.hh"
+#include "PrimaryGeneratorAction.hh"
+#include "CustomSteppingAction.hh"
+#include "CustomEventAction.hh"
+
+// Builds the generator, stepping and event actions once per worker thread (once in total for a sequential
+// run manager). The primary queue and the record store are shared by all of them; stepping settings are
+// kept here so workers started later get them too.
+class ActionInitialization : public G4VUserActionInitialization {
+public:
+    // storeFloat32 keeps the step records in float32; stepReserve is the number of steps every thread's
+    // record arena reserves before its first event
+    ActionInitialization(bool storeAll, bool storePrimary, bool storeFloat32 = false, size_t stepReserve = 0);
+    ~ActionInitialization() override;
+
+    void Build() const override;
+    void BuildForMaster() const override;
+
+    // Only change between runs, the workers read these without locking
+    void setPrimaries(std::vector<PrimaryGeneratorAction::Primary> primaries);
+    void clearPrimaries();
+    void setKillMomenta(double killMomenta);
+    void setKillSecondary(bool killSecondary);
+    // z positions (m) of the virtual scoring planes, see CustomSteppingAction::setScoringPlanes
+    void setScoringPlanes(const std::vector<double>& zPlanes);
+    void setKillRegions(const KillRegions& killRegions);
+    // Events of the following runs are also appended to the writer; nullptr stops writing. Not owned.
+    void setOutputWriter(StepFileWriter* outputWriter);
+
+    EventRecordStore& getRecordStore();
+
+private:
+    bool storeAll;
+    bool storePrimary;
+    bool storeFloat32;
+    size_t stepReserve;
+    double killMomenta;
+    bool killSecondary;
+    std::vector<double> scoringPlanes;
+    KillRegions killRegions;
+    StepFileWriter* outputWriter;
+
+    std::vector<PrimaryGeneratorAction::Primary> primaryQueue;
+    mutable EventRecordStore recordStore;
+
+    // Stepping actions of all threads built so far, owned by their run managers
+    mutable std::mutex mutex;
+    mutable std::vector<CustomSteppingAction*> steppingActions;
+    mutable std::vector<CustomEventAction*> eventActions;
+};
+
+#endif
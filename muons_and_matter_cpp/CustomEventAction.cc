@@ -3,6 +3,8 @@
 //
 
 #include "CustomEventAction.hh"
+#include "StepFile.hh"
+#include "CustomMagneticField.hh"
 #include "G4Event.hh"
 #include "G4EventManager.hh"
 #include "G4RunManager.hh"
@@ -10,7 +12,7 @@
 #include "G4SystemOfUnits.hh"
 
 CustomEventAction::CustomEventAction()
-        : G4UserEventAction()
+        : G4UserEventAction(), steppingAction(nullptr), recordStore(nullptr), outputWriter(nullptr)
 {
     // Constructor implementation
 }
@@ -34,7 +36,14 @@ void CustomEventAction::EndOfEventAction(const G4Event* event)
 {
     G4int eventID = event->GetEventID();
 //    G4cout << "Ending Event: " << eventID << G4endl;
-    // Add additional finalization code here
+    if (recordStore != nullptr && steppingAction != nullptr && recordStore->isRecording()) {
+        recordStore->store(eventID, *steppingAction);
+    }
+    if (outputWriter != nullptr && steppingAction != nullptr) {
+        outputWriter->appendEvent(eventID, steppingAction->records);
+    }
+    // Worker threads outlive runs, their field cache counts are published per event instead
+    CustomMagneticField::publishThreadCacheCounts();
 }
 
 CustomSteppingAction *CustomEventAction::getSteppingAction() const {
@@ -44,3 +53,93 @@ CustomSteppingAction *CustomEventAction::getSteppingAction() const {
 void CustomEventAction::setSteppingAction(CustomSteppingAction *steppingAction) {
     CustomEventAction::steppingAction = steppingAction;
 }
+
+void CustomEventAction::setRecordStore(EventRecordStore *recordStore) {
+    CustomEventAction::recordStore = recordStore;
+}
+
+void CustomEventAction::setOutputWriter(StepFileWriter *outputWriter) {
+    CustomEventAction::outputWriter = outputWriter;
+}
+
+EventRecordStore::EventRecordStore() : recording(false) {
+}
+
+void EventRecordStore::startRecording(size_t numEvents) {
+    std::lock_guard<std::mutex> lock(mutex);
+    events.assign(numEvents, StepArena());
+    killedTracks.assign(numEvents, 0);
+    stored.assign(numEvents, false);
+    recording = true;
+}
+
+void EventRecordStore::stopRecording() {
+    std::lock_guard<std::mutex> lock(mutex);
+    recording = false;
+}
+
+bool EventRecordStore::isRecording() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return recording;
+}
+
+void EventRecordStore::store(G4int eventID, const CustomSteppingAction& steppingAction) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!recording || eventID < 0 || static_cast<size_t>(eventID) >= events.size()) {
+        return;
+    }
+    events[eventID].assign(steppingAction.records);
+    killedTracks[eventID] = steppingAction.getNumKilledInRegions();
+    stored[eventID] = true;
+}
+
+bool EventRecordStore::merge(RunRecords& out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    out.clear();
+    out.offsets.reserve(events.size() + 1);
+    out.offsets.push_back(0);
+    out.killedTracks = std::move(killedTracks);
+    bool complete = true;
+    if (events.size() == 1) {
+        // A single event hands over its buffers as they are
+        complete = stored[0];
+        static_cast<StepArena&>(out) = std::move(events[0]);
+        out.offsets.push_back(static_cast<long>(out.size()));
+    } else {
+        size_t numSteps = 0;
+        for (const StepArena& event : events) {
+            numSteps += event.size();
+        }
+        if (!events.empty())
+            out.setFloat32(events[0].isFloat32());
+        out.reserve(numSteps);
+        for (size_t idx = 0; idx < events.size(); ++idx) {
+            complete = complete && stored[idx];
+            out.append(events[idx]);
+            out.offsets.push_back(static_cast<long>(out.size()));
+        }
+    }
+    events.clear();
+    killedTracks.clear();
+    stored.clear();
+    return complete;
+}
+
+void RunRecords::clear() {
+    StepArena::clear();
+    offsets.clear();
+    killedTracks.clear();
+}
+
+void RunRecords::appendRun(const RunRecords& other) {
+    if (offsets.empty())
+        offsets.push_back(0);
+    long shift = offsets.back();
+    for (size_t idx = 1; idx < other.offsets.size(); ++idx) {
+        offsets.push_back(other.offsets[idx] + shift);
+    }
+    killedTracks.insert(killedTracks.end(), other.killedTracks.begin(), other.killedTracks.end());
+    if (empty())
+        setFloat32(other.isFloat32());
+    append(other);
+}
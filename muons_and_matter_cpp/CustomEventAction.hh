@@ -9,8 +9,46 @@
 #include "G4UserEventAction.hh"
 #include "globals.hh"
 #include "CustomSteppingAction.hh"
+#include "StepArena.hh"
+#include <mutex>
+#include <vector>
 
 class G4Event;
+class StepFileWriter;
+
+// Steps of all events of a run back to back, the steps of event n are [offsets[n], offsets[n+1]).
+// killedTracks[n] is the number of tracks the kill regions stopped in event n.
+struct RunRecords : StepArena {
+    std::vector<long> offsets;
+    std::vector<long> killedTracks;
+
+    void clear();
+    // Appends the events of another run after the events of this one
+    void appendRun(const RunRecords& other);
+};
+
+// Collects the stored steps of every event of a run, from whichever worker thread processed it, by event ID.
+// One store is shared by the event actions of all threads.
+class EventRecordStore {
+public:
+    EventRecordStore();
+
+    void startRecording(size_t numEvents);
+    void stopRecording();
+    bool isRecording() const;
+    // Copies the steps of the stepping action, exactly sized, and its kill count as the records of event
+    // eventID. The stepping action keeps its buffers for the next event.
+    void store(G4int eventID, const CustomSteppingAction& steppingAction);
+    // Concatenates the recorded events in event order. Returns false if some event was not recorded.
+    bool merge(RunRecords& out);
+
+private:
+    mutable std::mutex mutex;
+    bool recording;
+    std::vector<StepArena> events;
+    std::vector<long> killedTracks;
+    std::vector<bool> stored;
+};
 
 class CustomEventAction : public G4UserEventAction
 {
@@ -23,10 +61,17 @@ public:
 
 private:
     CustomSteppingAction* steppingAction;
+    EventRecordStore* recordStore;
+    StepFileWriter* outputWriter;
 public:
     CustomSteppingAction *getSteppingAction() const;
 
     void setSteppingAction(CustomSteppingAction *steppingAction);
+
+    // While the store is recording, the steps of every event are handed to it at the end of the event
+    void setRecordStore(EventRecordStore* recordStore);
+    // Every event is also appended to the writer while one is set
+    void setOutputWriter(StepFileWriter* outputWriter);
 };
 
 
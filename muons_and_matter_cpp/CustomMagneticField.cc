@@ -1,14 +1,136 @@
 #include "CustomMagneticField.hh"
+#include "ParallelFor.hh"
 #include "G4SystemOfUnits.hh"
 #include <cmath>
 #include <limits>
 #include <algorithm>
 #include <iostream>
+#include <stdexcept>
 
-CustomMagneticField::CustomMagneticField(const std::map<std::string, std::vector<double>>& ranges, const std::vector<G4ThreeVector>& fields, InterpolationType interpType)
-    : fFields(fields), fInterpType(interpType) {
+namespace {
+    std::atomic<unsigned long> nextFieldInstanceId{1};
+
+    // Cache keys combine the instance id with the interpolation type
+    constexpr unsigned long kCacheKeyModes = 4;
+
+    // Last cell (LINEAR, CUBIC) or node (NEAREST_NEIGHBOR) looked up by this thread.
+    // lo/hi bound the region, in stored-domain coordinates, that the entry serves.
+    struct FieldLookupCache {
+        unsigned long key = 0; // fInstanceId * kCacheKeyModes + interpolation type, 0 = empty
+        double lo[3], hi[3];
+        int i, j, k;
+        double B[3];
+        double Bx[8], By[8], Bz[8];
+        unsigned long long hits = 0;
+        unsigned long long misses = 0;
+        // Where hits and misses are published, null for an entry that does not count
+        std::shared_ptr<FieldCacheCounters> counters;
+
+        inline void publish() {
+            if (counters && (hits != 0 || misses != 0)) {
+                counters->hits += hits;
+                counters->misses += misses;
+            }
+            hits = misses = 0;
+        }
+
+        // A thread's pending counts are published when it exits
+        ~FieldLookupCache() { publish(); }
+
+        inline bool contains(unsigned long lookupKey, double x, double y, double z) const {
+            return key == lookupKey && x >= lo[0] && x <= hi[0] && y >= lo[1] && y <= hi[1] && z >= lo[2] && z <= hi[2];
+        }
+    };
+
+    thread_local FieldLookupCache tlsLookupCache;
+
+    constexpr unsigned long long kCacheFlushInterval = 256;
+
+    // Symmetry policies for CustomMagneticField, see SymmetryType
+    struct NoSymmetry {
+        static inline void fold(const G4double P[4], double q[3], double sign[3]) {
+            q[0] = P[0];
+            q[1] = P[1];
+            q[2] = P[2];
+            sign[0] = sign[1] = sign[2] = 1.0;
+        }
+    };
+
+    struct XMirrorSymmetry {
+        static inline void fold(const G4double P[4], double q[3], double sign[3]) {
+            q[0] = std::fabs(P[0]);
+            q[1] = P[1];
+            q[2] = P[2];
+            sign[0] = (P[0] < 0) ? -1.0 : 1.0;
+            sign[1] = sign[2] = 1.0;
+        }
+    };
+
+    struct QuadrantSymmetry {
+        static inline void fold(const G4double P[4], double q[3], double sign[3]) {
+            const double sx = (P[0] < 0) ? -1.0 : 1.0;
+            const double sy = (P[1] < 0) ? -1.0 : 1.0;
+            q[0] = std::fabs(P[0]);
+            q[1] = std::fabs(P[1]);
+            q[2] = P[2];
+            sign[0] = sx * sy;
+            sign[1] = 1.0;
+            sign[2] = sy;
+        }
+    };
+
+    struct OctantSymmetry {
+        static inline void fold(const G4double P[4], double q[3], double sign[3]) {
+            const double sx = (P[0] < 0) ? -1.0 : 1.0;
+            const double sy = (P[1] < 0) ? -1.0 : 1.0;
+            const double sz = (P[2] < 0) ? -1.0 : 1.0;
+            q[0] = std::fabs(P[0]);
+            q[1] = std::fabs(P[1]);
+            q[2] = std::fabs(P[2]);
+            sign[0] = sx * sy;
+            sign[1] = 1.0;
+            sign[2] = sy * sz;
+        }
+    };
+
+    // Refills the entry for a new lookup key. Counts pending for another field go to that field's counters first.
+    inline void claimCacheEntry(FieldLookupCache& cache, unsigned long key,
+                                const std::shared_ptr<FieldCacheCounters>* counters) {
+        if (counters != nullptr && cache.counters.get() != counters->get()) {
+            cache.publish();
+            cache.counters = *counters;
+        }
+        cache.key = key;
+        cache.misses++;
+    }
+
+    inline void publishCacheCounts(FieldLookupCache& cache) {
+        if (cache.hits + cache.misses >= kCacheFlushInterval) {
+            cache.publish();
+        }
+    }
+}
+
+FieldMapBuffer FieldMapBuffer::fromVector(std::vector<double> values) {
+    auto holder = std::make_shared<std::vector<double>>(std::move(values));
+    FieldMapBuffer buffer;
+    buffer.data = holder->data();
+    buffer.size = holder->size();
+    buffer.isFloat32 = false;
+    buffer.owner = holder;
+    return buffer;
+}
+
+CustomMagneticField::CustomMagneticField(const std::map<std::string, std::vector<double>>& ranges, const FieldMapBuffer& fields, InterpolationType interpType, StorageType storageType, double sparseThreshold, SymmetryType symmetry)
+    : fInterpType(interpType), fStorageType(storageType), fSymmetry(symmetry), fInstanceId(nextFieldInstanceId++), fUseCache(true),
+      fCacheCounters(std::make_shared<FieldCacheCounters>()), nbx(0), nby(0), nbz(0), fSparseThreshold(sparseThreshold) {
     // Initialize grid parameters
     initializeGrid(ranges);
+    initializeStorage(fields);
+    if (fInterpType == CUBIC) {
+        initializeHermite();
+    }
+    initializeLookup();
 }
 
 CustomMagneticField::~CustomMagneticField() {
@@ -18,93 +140,662 @@ void CustomMagneticField::initializeGrid(const std::map<std::string, std::vector
     x_min = ranges.at("range_x")[0];
     x_max = ranges.at("range_x")[1];
     dx_inv = 1.0 / ranges.at("range_x")[2];
+    dx = ranges.at("range_x")[2];
 
     y_min = ranges.at("range_y")[0];
     y_max = ranges.at("range_y")[1];
     dy_inv = 1.0 / ranges.at("range_y")[2];
+    dy = ranges.at("range_y")[2];
 
     z_min = ranges.at("range_z")[0];
     z_max = ranges.at("range_z")[1];
     dz_inv = 1.0 / ranges.at("range_z")[2];
+    dz = ranges.at("range_z")[2];
 
     nx = static_cast<int>(std::round((x_max - x_min) * dx_inv))+1;
     ny = static_cast<int>(std::round((y_max - y_min) * dy_inv))+1;
     nz = static_cast<int>(std::round((z_max - z_min) * dz_inv))+1;
 
+    // Degenerate axes (a single node) collapse onto the same node instead of reading past the grid
+    const int sj = (ny > 1) ? nx * nz : 0;
+    const int si = (nx > 1) ? nz : 0;
+    const int sk = (nz > 1) ? 1 : 0;
+    for (int c = 0; c < 8; ++c) {
+        fCornerOffset[c] = ((c >> 2) & 1) * sj + ((c >> 1) & 1) * si + (c & 1) * sk;
+    }
+
     std::cout << "Grid initialized with dimensions: " << nx << " x " << ny << " x " << nz << std::endl;
 }
 
-void CustomMagneticField::GetFieldValueNearestNeighbor(const G4double Point[4], G4double *Bfield) const {
-    // Check if the point is outside the grid
-    if (fabs(Point[0]) > x_max || fabs(Point[1]) > y_max || fabs(Point[2]) > z_max) {
-        Bfield[0] = 0.0;
-        Bfield[1] = 0.0;
-        Bfield[2] = 0.0;
-        return;
-    }
-    // Determine the quadrant of the point
-    int quadrant = 0;
-    if (Point[0] >= 0 && Point[1] >= 0) {
-        quadrant = 1;
-    } else if (Point[0] < 0 && Point[1] >= 0) {
-        quadrant = 2;
-    } else if (Point[0] < 0 && Point[1] < 0) {
-        quadrant = 3;
-    } else if (Point[0] >= 0 && Point[1] < 0) {
-        quadrant = 4;
-    }
-    // Create a copy of Point and give it the value of the corresponding symmetry to the 1st quadrant
-    G4double SymmetricPoint[4] = {Point[0], Point[1], Point[2], Point[3]};
-    if (quadrant == 2) {
-        SymmetricPoint[0] *= -1;
-    } else if (quadrant == 3) {
-        SymmetricPoint[0] *= -1;
-        SymmetricPoint[1] *= -1;
-    } else if (quadrant == 4) {
-        SymmetricPoint[1] *= -1;
-    }
-
-    // Calculate nearest indices using integer arithmetic
-    int i = (int)round((SymmetricPoint[0] - x_min) * dx_inv);
-    int j = (int)round((SymmetricPoint[1] - y_min) * dy_inv);
-    int k = (int)round((SymmetricPoint[2] - z_min) * dz_inv);
-
-    // Check bounds
-    if (i < 0 || i >nx || j < 0 || j >ny || k < 0 || k > nz) {
-        Bfield[0] = Bfield[1] = Bfield[2] = 0.0;
-        return; // Out of bounds
-    }
-
-    // Compute flat index
-    int idx = j*(nx*nz)+i*nz+k; //indexing of the field must match this
-
-    // Assign the nearest values
-    Bfield[0] = fFields[idx].x();
-    Bfield[1] = fFields[idx].y();
-    Bfield[2] = fFields[idx].z();
-
-    // Apply symmetry to the magnetic field
-    if (quadrant == 2 || quadrant == 4) {
-        Bfield[0] = -Bfield[0];
-    }
-    if (quadrant == 3 || quadrant == 4) {
-        Bfield[2] = -Bfield[2];
+void CustomMagneticField::initializeStorage(const FieldMapBuffer& fields) {
+    const size_t nNodes = static_cast<size_t>(nx) * ny * nz;
+    if (fields.size != 3 * nNodes) {
+        throw std::runtime_error("Field map has " + std::to_string(fields.size / 3) + " nodes, grid expects " + std::to_string(nNodes));
+    }
+
+    if (fStorageType == EXTERNAL) {
+        fExternal = fields;
+    } else if (fStorageType == FLOAT32_SOA) {
+        fBx.resize(nNodes);
+        fBy.resize(nNodes);
+        fBz.resize(nNodes);
+        for (size_t idx = 0; idx < nNodes; ++idx) {
+            fBx[idx] = static_cast<float>(fields[3 * idx]);
+            fBy[idx] = static_cast<float>(fields[3 * idx + 1]);
+            fBz[idx] = static_cast<float>(fields[3 * idx + 2]);
+        }
+    } else {
+        nbx = (nx + kBrickMask) >> kBrickShift;
+        nby = (ny + kBrickMask) >> kBrickShift;
+        nbz = (nz + kBrickMask) >> kBrickShift;
+        const size_t nCoarse = static_cast<size_t>(nbx) * nby * nbz;
+
+        // First pass: find the bricks holding any node above the threshold
+        std::vector<char> occupied(nCoarse, 0);
+        for (int j = 0; j < ny; ++j) {
+            for (int i = 0; i < nx; ++i) {
+                for (int k = 0; k < nz; ++k) {
+                    const size_t idx = static_cast<size_t>(j) * (nx * nz) + i * nz + k;
+                    if (std::fabs(fields[3 * idx]) > fSparseThreshold || std::fabs(fields[3 * idx + 1]) > fSparseThreshold
+                        || std::fabs(fields[3 * idx + 2]) > fSparseThreshold) {
+                        occupied[coarseBrick(i, j, k)] = 1;
+                    }
+                }
+            }
+        }
+
+        // Slot 0 is the shared zero brick, so empty bricks are read without a branch
+        fBrickIndex.assign(nCoarse, 0);
+        int nStored = 1;
+        for (size_t b = 0; b < nCoarse; ++b) {
+            if (occupied[b]) {
+                fBrickIndex[b] = nStored++;
+            }
+        }
+
+        // Padding nodes past the grid edge stay zero, they are never read
+        fBricks.assign(nStored, FieldBrick{});
+        for (int j = 0; j < ny; ++j) {
+            for (int i = 0; i < nx; ++i) {
+                for (int k = 0; k < nz; ++k) {
+                    const int slot = fBrickIndex[coarseBrick(i, j, k)];
+                    if (slot == 0) {
+                        continue;
+                    }
+                    const size_t idx = static_cast<size_t>(j) * (nx * nz) + i * nz + k;
+                    FieldBrick& brick = fBricks[slot];
+                    const int local = brickLocal(i, j, k);
+                    brick.b[0][local] = static_cast<float>(fields[3 * idx]);
+                    brick.b[1][local] = static_cast<float>(fields[3 * idx + 1]);
+                    brick.b[2][local] = static_cast<float>(fields[3 * idx + 2]);
+                }
+            }
+        }
+    }
+
+    const char* storageNames[] = {"float32 SoA", "float32 bricks", "external"};
+    std::cout << "Field map storage: " << storageNames[fStorageType]
+              << ", " << getStorageBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+    if (fStorageType == FLOAT32_BRICKS) {
+        std::cout << "Non-empty bricks: " << fBricks.size() - 1 << " of " << fBrickIndex.size() << std::endl;
+    }
+}
+
+size_t CustomMagneticField::getStorageBytes() const {
+    // Borrowed memory is not counted, it belongs to the caller
+    return (fBx.size() + fBy.size() + fBz.size()) * sizeof(float) + fBricks.size() * sizeof(FieldBrick)
+           + fBrickIndex.size() * sizeof(int) + fHermite.size() * sizeof(float);
+}
+
+bool CustomMagneticField::mirroredAxis(int axis) const {
+    const double origin[3] = {x_min, y_min, z_min};
+    const double spacing[3] = {dx, dy, dz};
+    if (std::fabs(origin[axis]) > 1e-6 * spacing[axis]) {
+        return false;
+    }
+    switch (axis) {
+        case 0: return fSymmetry != NO_SYMMETRY;
+        case 1: return fSymmetry == QUADRANT || fSymmetry == OCTANT;
+        default: return fSymmetry == OCTANT;
+    }
+}
+
+double CustomMagneticField::mirrorParity(int component, int axis) const {
+    // Rows: mirrored axis x, y, z. Columns: Bx, By, Bz. Matches the sign factors of the symmetry policies.
+    static const double parity[3][3] = {{-1.0, 1.0, 1.0}, {-1.0, 1.0, -1.0}, {1.0, 1.0, -1.0}};
+    return parity[axis][component];
+}
+
+void CustomMagneticField::initializeHermite() {
+    const size_t nNodes = static_cast<size_t>(nx) * ny * nz;
+    fHermite.assign(nNodes * 3 * kHermiteSlots, 0.0f);
+    const int lo[3] = {0, 0, 0};
+    const int hi[3] = {nx, ny, nz};
+    buildHermite(lo, hi);
+    std::cout << "Hermite tables built: " << fHermite.size() * sizeof(float) / (1024.0 * 1024.0) << " MB" << std::endl;
+}
+
+void CustomMagneticField::buildHermite(const int lo[3], const int hi[3]) {
+    const int n[3] = {nx, ny, nz};
+    const size_t stride[3] = {static_cast<size_t>(nz), static_cast<size_t>(nx) * nz, 1};
+    const bool mirrored[3] = {mirroredAxis(0), mirroredAxis(1), mirroredAxis(2)};
+    float* table = fHermite.data();
+
+    // Central difference along axis of slot src into slot dst, in units of one cell. Mirrored axes get a ghost
+    // node at -1 equal to parity * node 1, other edges fall back to one-sided differences.
+    auto differentiate = [&](int src, int dst, int axis) {
+        parallelFor(hi[1] - lo[1], 0, [&](size_t jBegin, size_t jEnd) {
+            for (int j = lo[1] + static_cast<int>(jBegin); j < lo[1] + static_cast<int>(jEnd); ++j) {
+                for (int i = lo[0]; i < hi[0]; ++i) {
+                    for (int k = lo[2]; k < hi[2]; ++k) {
+                        const int ijk[3] = {i, j, k};
+                        const int pos = ijk[axis];
+                        const size_t node = static_cast<size_t>(j) * (nx * nz) + i * nz + k;
+                        for (int c = 0; c < 3; ++c) {
+                            const float* f = table + node * 3 * kHermiteSlots + c * kHermiteSlots + src;
+                            const ptrdiff_t step = static_cast<ptrdiff_t>(stride[axis] * 3 * kHermiteSlots);
+                            double derivative = 0.0;
+                            if (n[axis] == 1) {
+                                derivative = 0.0;
+                            } else if (pos == 0) {
+                                derivative = mirrored[axis] ? 0.5 * (1.0 - mirrorParity(c, axis)) * f[step] : f[step] - f[0];
+                            } else if (pos == n[axis] - 1) {
+                                derivative = f[0] - f[-step];
+                            } else {
+                                derivative = 0.5 * (f[step] - f[-step]);
+                            }
+                            table[node * 3 * kHermiteSlots + c * kHermiteSlots + dst] = static_cast<float>(derivative);
+                        }
+                    }
+                }
+            }
+        });
+    };
+
+    // Values first, then each derivative from the slot one order below it, so every pass only reads finished slots
+    parallelFor(hi[1] - lo[1], 0, [&](size_t jBegin, size_t jEnd) {
+        for (int j = lo[1] + static_cast<int>(jBegin); j < lo[1] + static_cast<int>(jEnd); ++j) {
+            for (int i = lo[0]; i < hi[0]; ++i) {
+                for (int k = lo[2]; k < hi[2]; ++k) {
+                    const size_t node = static_cast<size_t>(j) * (nx * nz) + i * nz + k;
+                    double B[3];
+                    loadNode(i, j, k, B);
+                    for (int c = 0; c < 3; ++c) {
+                        table[node * 3 * kHermiteSlots + c * kHermiteSlots] = static_cast<float>(B[c]);
+                    }
+                }
+            }
+        }
+    });
+    differentiate(0, 1, 0); // d/dx
+    differentiate(0, 2, 1); // d/dy
+    differentiate(0, 3, 2); // d/dz
+    differentiate(1, 4, 1); // d2/dxdy
+    differentiate(1, 5, 2); // d2/dxdz
+    differentiate(2, 6, 2); // d2/dydz
+    differentiate(4, 7, 2); // d3/dxdydz
+}
+
+void CustomMagneticField::updateRegion(const FieldMapBuffer& values, const int begin[3], const int count[3]) {
+    checkRegion(begin, count);
+    if (values.size != 3 * static_cast<size_t>(count[0]) * count[1] * count[2]) {
+        throw std::runtime_error("Field update has " + std::to_string(values.size / 3) + " nodes, the region has " +
+                                 std::to_string(static_cast<size_t>(count[0]) * count[1] * count[2]));
+    }
+    if (fStorageType == EXTERNAL && fExternal.readOnly) {
+        throw std::runtime_error("The field map is read in place from a read-only mapping (a detector bundle), it cannot "
+                                 "be updated. Initialize with a copying storage such as \"soa\" to update it.");
+    }
+    if (fStorageType == EXTERNAL) {
+        throw std::runtime_error("The field map is read from the caller's buffer, write into it and call regionModified().");
+    }
+
+    for (int jj = 0; jj < count[1]; ++jj) {
+        for (int ii = 0; ii < count[0]; ++ii) {
+            for (int kk = 0; kk < count[2]; ++kk) {
+                const int i = begin[0] + ii, j = begin[1] + jj, k = begin[2] + kk;
+                const size_t src = 3 * ((static_cast<size_t>(jj) * count[0] + ii) * count[2] + kk);
+                const float B[3] = {static_cast<float>(values[src]), static_cast<float>(values[src + 1]),
+                                    static_cast<float>(values[src + 2])};
+                if (fStorageType == FLOAT32_SOA) {
+                    const size_t idx = static_cast<size_t>(j) * (nx * nz) + i * nz + k;
+                    fBx[idx] = B[0];
+                    fBy[idx] = B[1];
+                    fBz[idx] = B[2];
+                    continue;
+                }
+                int& slot = fBrickIndex[coarseBrick(i, j, k)];
+                if (slot == 0) {
+                    if (std::fabs(B[0]) <= fSparseThreshold && std::fabs(B[1]) <= fSparseThreshold &&
+                        std::fabs(B[2]) <= fSparseThreshold) {
+                        continue;
+                    }
+                    // The brick was empty, its other nodes read zero before and still do. Bricks are not freed
+                    // again when an update zeroes them.
+                    slot = static_cast<int>(fBricks.size());
+                    fBricks.push_back(FieldBrick{});
+                }
+                const int local = brickLocal(i, j, k);
+                for (int c = 0; c < 3; ++c) {
+                    fBricks[slot].b[c][local] = B[c];
+                }
+            }
+        }
     }
+    regionModified(begin, count);
+}
+
+void CustomMagneticField::regionModified(const int begin[3], const int count[3]) {
+    checkRegion(begin, count);
+    // Every thread's cached cell belongs to the old id, so its next lookup reads the new values
+    fInstanceId = nextFieldInstanceId++;
+    if (fInterpType == CUBIC) {
+        // Derivatives reach one node past the changed values
+        const int n[3] = {nx, ny, nz};
+        int lo[3], hi[3];
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = std::max(begin[a] - 1, 0);
+            hi[a] = std::min(begin[a] + count[a] + 1, n[a]);
+        }
+        buildHermite(lo, hi);
+    }
+}
+
+void CustomMagneticField::checkRegion(const int begin[3], const int count[3]) const {
+    const int n[3] = {nx, ny, nz};
+    for (int a = 0; a < 3; ++a) {
+        if (begin[a] < 0 || count[a] < 0 || begin[a] + count[a] > n[a]) {
+            throw std::runtime_error("Field update region lies outside the " + std::to_string(nx) + " x " +
+                                     std::to_string(ny) + " x " + std::to_string(nz) + " grid.");
+        }
+    }
+}
+
+void CustomMagneticField::getGridShape(int shape[3]) const {
+    shape[0] = nx;
+    shape[1] = ny;
+    shape[2] = nz;
+}
+
+bool CustomMagneticField::emptyBrickRegion(int i, int j, int k, bool cells, double lo[3], double hi[3]) const {
+    if (fStorageType != FLOAT32_BRICKS || fBrickIndex[coarseBrick(i, j, k)] != 0) {
+        return false;
+    }
+    // A cell crossing into the next brick may see non-zero corners
+    if (cells && ((i & kBrickMask) == kBrickMask || (j & kBrickMask) == kBrickMask || (k & kBrickMask) == kBrickMask)) {
+        return false;
+    }
+
+    const int node0[3] = {i & ~kBrickMask, j & ~kBrickMask, k & ~kBrickMask};
+    const int n[3] = {nx, ny, nz};
+    const double origin[3] = {x_min, y_min, z_min};
+    const double spacing[3] = {dx, dy, dz};
+    const double extent[3] = {x_max, y_max, z_max};
+    for (int a = 0; a < 3; ++a) {
+        const int node1 = std::min(node0[a] + kBrickMask, n[a] - 1);
+        if (cells) {
+            lo[a] = origin[a] + node0[a] * spacing[a];
+            hi[a] = std::min(origin[a] + node1 * spacing[a], extent[a]);
+        } else {
+            // Same clipping as the nearest neighbour bounds checks
+            lo[a] = std::max(origin[a] + (node0[a] - 0.5) * spacing[a], origin[a]);
+            hi[a] = std::min(origin[a] + (node1 + 0.5) * spacing[a], extent[a]);
+        }
+    }
+    return true;
+}
+
+void CustomMagneticField::setLookupCache(bool enabled) {
+    fUseCache = enabled;
+    std::cout << "Field lookup cache: " << (enabled ? "on" : "off") << std::endl;
+}
+
+void CustomMagneticField::publishThreadCacheCounts() {
+    tlsLookupCache.publish();
+}
+
+void CustomMagneticField::getCacheStatistics(unsigned long long& hits, unsigned long long& misses) const {
+    publishThreadCacheCounts();
+    hits = fCacheCounters->hits;
+    misses = fCacheCounters->misses;
+}
+
+void CustomMagneticField::resetCacheStatistics() {
+    fCacheCounters->hits = 0;
+    fCacheCounters->misses = 0;
+}
+
+void CustomMagneticField::loadNode(int i, int j, int k, double B[3]) const {
+    if (fStorageType == FLOAT32_SOA) {
+        const size_t idx = static_cast<size_t>(j) * (nx * nz) + i * nz + k;
+        B[0] = fBx[idx];
+        B[1] = fBy[idx];
+        B[2] = fBz[idx];
+    } else if (fStorageType == EXTERNAL) {
+        const size_t idx = 3 * (static_cast<size_t>(j) * (nx * nz) + i * nz + k);
+        B[0] = fExternal[idx];
+        B[1] = fExternal[idx + 1];
+        B[2] = fExternal[idx + 2];
+    } else {
+        const FieldBrick& brick = brickAt(i, j, k);
+        const int local = brickLocal(i, j, k);
+        B[0] = brick.b[0][local];
+        B[1] = brick.b[1][local];
+        B[2] = brick.b[2][local];
+    }
+}
+
+void CustomMagneticField::loadCell(int i, int j, int k, double Bx[8], double By[8], double Bz[8]) const {
+    if (fStorageType == FLOAT32_SOA) {
+        const size_t base = static_cast<size_t>(j) * (nx * nz) + i * nz + k;
+        const float* bx = fBx.data() + base;
+        const float* by = fBy.data() + base;
+        const float* bz = fBz.data() + base;
+        for (int c = 0; c < 8; ++c) {
+            Bx[c] = bx[fCornerOffset[c]];
+            By[c] = by[fCornerOffset[c]];
+            Bz[c] = bz[fCornerOffset[c]];
+        }
+    } else if (fStorageType == EXTERNAL) {
+        const size_t base = 3 * (static_cast<size_t>(j) * (nx * nz) + i * nz + k);
+        if (fExternal.isFloat32) {
+            const float* cell = static_cast<const float*>(fExternal.data) + base;
+            for (int c = 0; c < 8; ++c) {
+                Bx[c] = cell[3 * fCornerOffset[c]];
+                By[c] = cell[3 * fCornerOffset[c] + 1];
+                Bz[c] = cell[3 * fCornerOffset[c] + 2];
+            }
+        } else {
+            const double* cell = static_cast<const double*>(fExternal.data) + base;
+            for (int c = 0; c < 8; ++c) {
+                Bx[c] = cell[3 * fCornerOffset[c]];
+                By[c] = cell[3 * fCornerOffset[c] + 1];
+                Bz[c] = cell[3 * fCornerOffset[c] + 2];
+            }
+        }
+    } else {
+        // Upper corner indices, collapsed onto the lower ones along degenerate axes
+        const int ii[2] = {i, i + (nx > 1)};
+        const int jj[2] = {j, j + (ny > 1)};
+        const int kk[2] = {k, k + (nz > 1)};
+        for (int c = 0; c < 8; ++c) {
+            const int ci = ii[(c >> 1) & 1], cj = jj[(c >> 2) & 1], ck = kk[c & 1];
+            const FieldBrick& brick = brickAt(ci, cj, ck);
+            const int local = brickLocal(ci, cj, ck);
+            Bx[c] = brick.b[0][local];
+            By[c] = brick.b[1][local];
+            Bz[c] = brick.b[2][local];
+        }
+    }
+}
+
+template <class Symmetry>
+void CustomMagneticField::lookupNearest(const G4double Point[4], G4double *Bfield) const {
+    // Map the point into the stored domain
+    double q[3], sign[3];
+    Symmetry::fold(Point, q, sign);
+
+    FieldLookupCache localCache;
+    FieldLookupCache& cache = fUseCache ? tlsLookupCache : localCache;
+    const unsigned long key = fInstanceId * kCacheKeyModes + NEAREST_NEIGHBOR;
+
+    if (cache.contains(key, q[0], q[1], q[2])) {
+        cache.hits++;
+    } else {
+        // Check if the point is outside the grid
+        if (q[0] < x_min || q[0] > x_max || q[1] < y_min || q[1] > y_max || q[2] < z_min || q[2] > z_max) {
+            Bfield[0] = 0.0;
+            Bfield[1] = 0.0;
+            Bfield[2] = 0.0;
+            return;
+        }
+
+        // Calculate nearest indices using integer arithmetic
+        int i = (int)round((q[0] - x_min) * dx_inv);
+        int j = (int)round((q[1] - y_min) * dy_inv);
+        int k = (int)round((q[2] - z_min) * dz_inv);
+
+        // Check bounds
+        if (i < 0 || i >= nx || j < 0 || j >= ny || k < 0 || k >= nz) {
+            Bfield[0] = Bfield[1] = Bfield[2] = 0.0;
+            return; // Out of bounds
+        }
+
+        // Region served by this node, clipped to where the checks above accept points.
+        // Inside an empty brick the entry serves the whole brick.
+        claimCacheEntry(cache, key, fUseCache ? &fCacheCounters : nullptr);
+        cache.i = i;
+        cache.j = j;
+        cache.k = k;
+        if (emptyBrickRegion(i, j, k, false, cache.lo, cache.hi)) {
+            cache.B[0] = cache.B[1] = cache.B[2] = 0.0;
+        } else {
+            cache.lo[0] = std::max(x_min + (i - 0.5) * dx, x_min);
+            cache.hi[0] = std::min(x_min + (i + 0.5) * dx, x_max);
+            cache.lo[1] = std::max(y_min + (j - 0.5) * dy, y_min);
+            cache.hi[1] = std::min(y_min + (j + 0.5) * dy, y_max);
+            cache.lo[2] = std::max(z_min + (k - 0.5) * dz, z_min);
+            cache.hi[2] = std::min(z_min + (k + 0.5) * dz, z_max);
+            loadNode(i, j, k, cache.B);
+        }
+    }
+    publishCacheCounts(cache);
+
+    // Assign the nearest values, mirrored back to the point
+    Bfield[0] = sign[0] * cache.B[0] * tesla;
+    Bfield[1] = sign[1] * cache.B[1] * tesla;
+    Bfield[2] = sign[2] * cache.B[2] * tesla;
     //debug prints
     //std::cout << "Evaluating at point: (" << Point[0]/m << ", " << Point[1]/m << ", " << Point[2]/m << ")" << std::endl;
-    //std::cout << "Symmetric point: (" << SymmetricPoint[0]/m << ", " << SymmetricPoint[1]/m << ", " << SymmetricPoint[2]/m << ")" << std::endl;
-    //std::cout << "Nearest neighbor point index: (" << i << ", " << j << ", " << k << ")" << std::endl;
+    //std::cout << "Symmetric point: (" << q[0]/m << ", " << q[1]/m << ", " << q[2]/m << ")" << std::endl;
+    //std::cout << "Nearest neighbor point index: (" << cache.i << ", " << cache.j << ", " << cache.k << ")" << std::endl;
     //std::cout << "Magnetic field at nearest neighbor: (" << Bfield[0]/tesla << ", " << Bfield[1]/tesla << ", " << Bfield[2]/tesla << ")" << std::endl;
 }
 
-void CustomMagneticField::GetFieldValueLinear(const G4double Point[4], G4double *Bfield) const {
-    // TODO
+template <class Symmetry>
+void CustomMagneticField::lookupLinear(const G4double Point[4], G4double *Bfield) const {
+    // Map the point into the stored domain
+    double q[3], sign[3];
+    Symmetry::fold(Point, q, sign);
+    const double xs = q[0];
+    const double ys = q[1];
+    const double zs = q[2];
+
+    FieldLookupCache localCache;
+    FieldLookupCache& cache = fUseCache ? tlsLookupCache : localCache;
+    const unsigned long key = fInstanceId * kCacheKeyModes + LINEAR;
+
+    if (cache.contains(key, xs, ys, zs)) {
+        cache.hits++;
+    } else {
+        if (xs < x_min || xs > x_max || ys < y_min || ys > y_max || zs < z_min || zs > z_max) {
+            Bfield[0] = Bfield[1] = Bfield[2] = 0.0;
+            return;
+        }
+
+        // Lower corner of the enclosing cell, clamped so that the upper corner stays inside the grid
+        const int i = std::min(static_cast<int>((xs - x_min) * dx_inv), std::max(nx - 2, 0));
+        const int j = std::min(static_cast<int>((ys - y_min) * dy_inv), std::max(ny - 2, 0));
+        const int k = std::min(static_cast<int>((zs - z_min) * dz_inv), std::max(nz - 2, 0));
+
+        // Inside an empty brick the entry serves every cell that does not reach into a neighbouring brick
+        claimCacheEntry(cache, key, fUseCache ? &fCacheCounters : nullptr);
+        cache.i = i;
+        cache.j = j;
+        cache.k = k;
+        if (emptyBrickRegion(i, j, k, true, cache.lo, cache.hi)) {
+            std::fill(cache.Bx, cache.Bx + 8, 0.0);
+            std::fill(cache.By, cache.By + 8, 0.0);
+            std::fill(cache.Bz, cache.Bz + 8, 0.0);
+        } else {
+            cache.lo[0] = x_min + i * dx;
+            cache.hi[0] = std::min(x_min + (i + 1) * dx, x_max);
+            cache.lo[1] = y_min + j * dy;
+            cache.hi[1] = std::min(y_min + (j + 1) * dy, y_max);
+            cache.lo[2] = z_min + k * dz;
+            cache.hi[2] = std::min(z_min + (k + 1) * dz, z_max);
+            loadCell(i, j, k, cache.Bx, cache.By, cache.Bz);
+        }
+    }
+    publishCacheCounts(cache);
+
+    // Fractional position inside the cell
+    const double fx = std::min(std::max((xs - x_min) * dx_inv - cache.i, 0.0), 1.0);
+    const double fy = std::min(std::max((ys - y_min) * dy_inv - cache.j, 0.0), 1.0);
+    const double fz = std::min(std::max((zs - z_min) * dz_inv - cache.k, 0.0), 1.0);
+
+    const double wx[2] = {1.0 - fx, fx};
+    const double wy[2] = {1.0 - fy, fy};
+    const double wz[2] = {1.0 - fz, fz};
+
+    // Corner weights in the same (dj, di, dk) order as fCornerOffset
+    double weight[8];
+    for (int c = 0; c < 8; ++c) {
+        weight[c] = wy[(c >> 2) & 1] * wx[(c >> 1) & 1] * wz[c & 1];
+    }
+
+    double bx = 0.0, by = 0.0, bz = 0.0;
+    for (int c = 0; c < 8; ++c) {
+        bx += weight[c] * cache.Bx[c];
+        by += weight[c] * cache.By[c];
+        bz += weight[c] * cache.Bz[c];
+    }
+
+    // Mirror back to the point
+    Bfield[0] = sign[0] * bx * tesla;
+    Bfield[1] = sign[1] * by * tesla;
+    Bfield[2] = sign[2] * bz * tesla;
 }
 
-void CustomMagneticField::GetFieldValue(const G4double Point[4], G4double *Bfield) const {
+template <class Symmetry>
+void CustomMagneticField::lookupCubic(const G4double Point[4], G4double *Bfield) const {
+    // Map the point into the stored domain
+    double q[3], sign[3];
+    Symmetry::fold(Point, q, sign);
+
+    FieldLookupCache localCache;
+    FieldLookupCache& cache = fUseCache ? tlsLookupCache : localCache;
+    const unsigned long key = fInstanceId * kCacheKeyModes + CUBIC;
+
+    if (cache.contains(key, q[0], q[1], q[2])) {
+        cache.hits++;
+    } else {
+        if (q[0] < x_min || q[0] > x_max || q[1] < y_min || q[1] > y_max || q[2] < z_min || q[2] > z_max) {
+            Bfield[0] = Bfield[1] = Bfield[2] = 0.0;
+            return;
+        }
+
+        // Lower corner of the enclosing cell, clamped so that the upper corner stays inside the grid.
+        // Derivatives reach into neighbouring bricks, so empty bricks get no special treatment here.
+        const int i = std::min(static_cast<int>((q[0] - x_min) * dx_inv), std::max(nx - 2, 0));
+        const int j = std::min(static_cast<int>((q[1] - y_min) * dy_inv), std::max(ny - 2, 0));
+        const int k = std::min(static_cast<int>((q[2] - z_min) * dz_inv), std::max(nz - 2, 0));
+
+        claimCacheEntry(cache, key, fUseCache ? &fCacheCounters : nullptr);
+        cache.i = i;
+        cache.j = j;
+        cache.k = k;
+        cache.lo[0] = x_min + i * dx;
+        cache.hi[0] = std::min(x_min + (i + 1) * dx, x_max);
+        cache.lo[1] = y_min + j * dy;
+        cache.hi[1] = std::min(y_min + (j + 1) * dy, y_max);
+        cache.lo[2] = z_min + k * dz;
+        cache.hi[2] = std::min(z_min + (k + 1) * dz, z_max);
+    }
+    publishCacheCounts(cache);
+
+    const double fx = std::min(std::max((q[0] - x_min) * dx_inv - cache.i, 0.0), 1.0);
+    const double fy = std::min(std::max((q[1] - y_min) * dy_inv - cache.j, 0.0), 1.0);
+    const double fz = std::min(std::max((q[2] - z_min) * dz_inv - cache.k, 0.0), 1.0);
+
+    // Cubic Hermite basis, indexed [corner side][0 = value, 1 = derivative]
+    auto hermite = [](double t, double h[2][2]) {
+        const double t2 = t * t, t3 = t2 * t;
+        h[0][0] = 2 * t3 - 3 * t2 + 1;
+        h[0][1] = t3 - 2 * t2 + t;
+        h[1][0] = -2 * t3 + 3 * t2;
+        h[1][1] = t3 - t2;
+    };
+    double hx[2][2], hy[2][2], hz[2][2];
+    hermite(fx, hx);
+    hermite(fy, hy);
+    hermite(fz, hz);
+
+    // Derivative order along (x, y, z) held by each table slot
+    static const int slotOrder[kHermiteSlots][3] = {{0, 0, 0}, {1, 0, 0}, {0, 1, 0}, {0, 0, 1},
+                                                    {1, 1, 0}, {1, 0, 1}, {0, 1, 1}, {1, 1, 1}};
+
+    const size_t base = static_cast<size_t>(cache.j) * (nx * nz) + cache.i * nz + cache.k;
+    double bx = 0.0, by = 0.0, bz = 0.0;
+    for (int c = 0; c < 8; ++c) {
+        const int dj = (c >> 2) & 1, di = (c >> 1) & 1, dk = c & 1;
+        const float* record = fHermite.data() + (base + fCornerOffset[c]) * 3 * kHermiteSlots;
+        double weight[kHermiteSlots];
+        for (int s = 0; s < kHermiteSlots; ++s) {
+            weight[s] = hx[di][slotOrder[s][0]] * hy[dj][slotOrder[s][1]] * hz[dk][slotOrder[s][2]];
+        }
+        for (int s = 0; s < kHermiteSlots; ++s) {
+            bx += weight[s] * record[s];
+            by += weight[s] * record[kHermiteSlots + s];
+            bz += weight[s] * record[2 * kHermiteSlots + s];
+        }
+    }
+
+    // Mirror back to the point
+    Bfield[0] = sign[0] * bx * tesla;
+    Bfield[1] = sign[1] * by * tesla;
+    Bfield[2] = sign[2] * bz * tesla;
+}
+
+void CustomMagneticField::initializeLookup() {
+    switch (fSymmetry) {
+        case NO_SYMMETRY:
+            fNearestLookup = &CustomMagneticField::lookupNearest<NoSymmetry>;
+            fLinearLookup = &CustomMagneticField::lookupLinear<NoSymmetry>;
+            fCubicLookup = &CustomMagneticField::lookupCubic<NoSymmetry>;
+            break;
+        case X_MIRROR:
+            fNearestLookup = &CustomMagneticField::lookupNearest<XMirrorSymmetry>;
+            fLinearLookup = &CustomMagneticField::lookupLinear<XMirrorSymmetry>;
+            fCubicLookup = &CustomMagneticField::lookupCubic<XMirrorSymmetry>;
+            break;
+        case QUADRANT:
+            fNearestLookup = &CustomMagneticField::lookupNearest<QuadrantSymmetry>;
+            fLinearLookup = &CustomMagneticField::lookupLinear<QuadrantSymmetry>;
+            fCubicLookup = &CustomMagneticField::lookupCubic<QuadrantSymmetry>;
+            break;
+        case OCTANT:
+            fNearestLookup = &CustomMagneticField::lookupNearest<OctantSymmetry>;
+            fLinearLookup = &CustomMagneticField::lookupLinear<OctantSymmetry>;
+            fCubicLookup = &CustomMagneticField::lookupCubic<OctantSymmetry>;
+            break;
+        default:
+            throw std::runtime_error("Unknown field map symmetry.");
+    }
     if (fInterpType == NEAREST_NEIGHBOR) {
-        GetFieldValueNearestNeighbor(Point, Bfield);
+        fLookup = fNearestLookup;
+    } else if (fInterpType == LINEAR) {
+        fLookup = fLinearLookup;
     } else {
-        GetFieldValueLinear(Point, Bfield);
+        fLookup = fCubicLookup;
+    }
+}
+
+void CustomMagneticField::GetFieldValueNearestNeighbor(const G4double Point[4], G4double *Bfield) const {
+    (this->*fNearestLookup)(Point, Bfield);
+}
+
+void CustomMagneticField::GetFieldValueLinear(const G4double Point[4], G4double *Bfield) const {
+    (this->*fLinearLookup)(Point, Bfield);
+}
+
+void CustomMagneticField::GetFieldValueCubic(const G4double Point[4], G4double *Bfield) const {
+    if (fHermite.empty()) {
+        throw std::runtime_error("Cubic lookups need a field constructed with CUBIC interpolation.");
     }
-}
\ No newline at end of file
+    (this->*fCubicLookup)(Point, Bfield);
+}
+
+void CustomMagneticField::GetFieldValue(const G4double Point[4], G4double *Bfield) const {
+    (this->*fLookup)(Point, Bfield);
+}
@@ -1,27 +1,171 @@
+#ifndef CUSTOMMAGNETICFIELD_HH
+#define CUSTOMMAGNETICFIELD_HH
+
 #include <vector>
 #include <map>
+#include <memory>
+#include <atomic>
 #include "G4ThreeVector.hh"
 #include "G4MagneticField.hh"
 
+// Read-only view of a flat Bx, By, Bz field map in tesla, flat index j*(nx*nz)+i*nz+k.
+// The memory belongs to someone else (e.g. a numpy array); owner keeps it alive as long as any copy of the view exists.
+struct FieldMapBuffer {
+    const void* data = nullptr;
+    size_t size = 0; // Number of values, 3 per node
+    bool isFloat32 = false;
+    // The memory cannot be written at all, e.g. a read-only file mapping
+    bool readOnly = false;
+    std::shared_ptr<const void> owner;
+
+    bool empty() const { return size == 0; }
+    double operator[](size_t idx) const {
+        return isFloat32 ? static_cast<const float*>(data)[idx] : static_cast<const double*>(data)[idx];
+    }
+
+    static FieldMapBuffer fromVector(std::vector<double> values);
+};
+
+// Lookup cache hit/miss totals of one field. Threads hold on to the counters they report to, so counts
+// pending in a thread can still be published after the field changed its id or was deleted.
+struct FieldCacheCounters {
+    std::atomic<unsigned long long> hits{0};
+    std::atomic<unsigned long long> misses{0};
+};
+
 class CustomMagneticField : public G4MagneticField {
 public:
-    enum InterpolationType { NEAREST_NEIGHBOR, LINEAR };
-    CustomMagneticField(const std::map<std::string, std::vector<double>>& ranges, const std::vector<G4ThreeVector>& fields, InterpolationType interpType);
+    // CUBIC: C1 tricubic Hermite interpolation from per-node derivative tables built at construction
+    enum InterpolationType { NEAREST_NEIGHBOR, LINEAR, CUBIC };
+    // FLOAT32_SOA: one float plane per component in the flat j*(nx*nz)+i*nz+k order.
+    // FLOAT32_BRICKS: 4x4x4 node bricks, each brick a contiguous block of whole cache lines. Bricks whose nodes
+    //                 are all within sparseThreshold (tesla) of zero are not stored and read as zero.
+    // EXTERNAL: no copy, lookups read the caller's buffer directly.
+    enum StorageType { FLOAT32_SOA, FLOAT32_BRICKS, EXTERNAL };
+    // Which part of space the map covers; the rest is mirrored from it.
+    // NO_SYMMETRY: the full range, nothing mirrored.
+    // X_MIRROR: x >= 0, Bx flips sign for x < 0.
+    // QUADRANT: x >= 0, y >= 0, Bx flips for x*y < 0 and Bz for y < 0 (the original 4-fold convention).
+    // OCTANT: QUADRANT plus z >= 0, Bz also flips for z < 0.
+    enum SymmetryType { NO_SYMMETRY, X_MIRROR, QUADRANT, OCTANT };
+
+    CustomMagneticField(const std::map<std::string, std::vector<double>>& ranges, const FieldMapBuffer& fields, InterpolationType interpType, StorageType storageType = FLOAT32_SOA, double sparseThreshold = 0.0, SymmetryType symmetry = QUADRANT);
     ~CustomMagneticField();
 
     void GetFieldValue(const G4double Point[4], G4double *Bfield) const override;
     void GetFieldValueNearestNeighbor(const G4double Point[4], G4double *Bfield) const;
     void GetFieldValueLinear(const G4double Point[4], G4double *Bfield) const;
+    void GetFieldValueCubic(const G4double Point[4], G4double *Bfield) const;
+
+    size_t getStorageBytes() const;
+
+    // In-place updates, between runs only. A region is the block of nodes [begin, begin + count) with node
+    // indices in (x, y, z) order. updateRegion() copies values, the region's nodes in the map's flat order,
+    // into the storage; with EXTERNAL storage write into the shared buffer instead and call regionModified().
+    // A read-only EXTERNAL buffer (a detector bundle's mapping) cannot be updated at all.
+    // Both invalidate the lookup caches and rebuild the CUBIC tables around the region.
+    void updateRegion(const FieldMapBuffer& values, const int begin[3], const int count[3]);
+    void regionModified(const int begin[3], const int count[3]);
+    // Number of nodes along x, y, z
+    void getGridShape(int shape[3]) const;
+
+    // Each thread remembers the last cell (or node) it looked up, repeated queries inside it skip the
+    // bounds test, index computation and gather. Counters are collected per thread and published every
+    // few hundred lookups, when the thread moves on to another field, when it exits and when it calls
+    // publishThreadCacheCounts() (every event does); getCacheStatistics() publishes the calling thread's.
+    void setLookupCache(bool enabled);
+    static void publishThreadCacheCounts();
+    void getCacheStatistics(unsigned long long& hits, unsigned long long& misses) const;
+    void resetCacheStatistics();
 
 private:
-    std::vector<G4ThreeVector> fFields;
+    static constexpr int kBrickShift = 2;
+    static constexpr int kBrickSize = 1 << kBrickShift;
+    static constexpr int kBrickMask = kBrickSize - 1;
+    static constexpr int kBrickNodes = kBrickSize * kBrickSize * kBrickSize;
+
+    struct alignas(64) FieldBrick {
+        float b[3][kBrickNodes];
+    };
+
     InterpolationType fInterpType;
+    StorageType fStorageType;
+    SymmetryType fSymmetry;
+
+    // Lookup kernel for this instance's interpolation and symmetry, chosen once at construction
+    typedef void (CustomMagneticField::*LookupFunction)(const G4double Point[4], G4double *Bfield) const;
+    LookupFunction fLookup;
+    LookupFunction fNearestLookup;
+    LookupFunction fLinearLookup;
+    LookupFunction fCubicLookup;
+
+    // Unique per instance, and renewed by every update, so that a thread's cache never serves a field allocated at a
+    // recycled address or values that were overwritten
+    unsigned long fInstanceId;
+    bool fUseCache;
+    std::shared_ptr<FieldCacheCounters> fCacheCounters;
+
+    // FLOAT32_SOA
+    std::vector<float> fBx, fBy, fBz;
+    // FLOAT32_BRICKS: fBrickIndex maps every coarse brick to its slot in fBricks, empty bricks to the zero brick in slot 0
+    std::vector<FieldBrick> fBricks;
+    std::vector<int> fBrickIndex;
+    int nbx, nby, nbz;
+    double fSparseThreshold;
+    // EXTERNAL
+    FieldMapBuffer fExternal;
+
+    // CUBIC: per node and component the value and the derivatives d/dx, d/dy, d/dz, d2/dxdy, d2/dxdz, d2/dydz,
+    // d3/dxdydz in tesla per cell, laid out [node][component][kHermiteSlots]
+    static constexpr int kHermiteSlots = 8;
+    std::vector<float> fHermite;
 
     // Grid parameters
     double x_min, x_max, dx_inv;
     double y_min, y_max, dy_inv;
     double z_min, z_max, dz_inv;
+    double dx, dy, dz;
     int nx, ny, nz;
 
+    // Flat offsets of the 8 corners of a cell relative to its lower corner, ordered (dj, di, dk)
+    int fCornerOffset[8];
+
     void initializeGrid(const std::map<std::string, std::vector<double>>& ranges);
-};
\ No newline at end of file
+    void initializeStorage(const FieldMapBuffer& fields);
+    void initializeLookup();
+    void initializeHermite();
+    // Recomputes the CUBIC table for the nodes [lo, hi)
+    void buildHermite(const int lo[3], const int hi[3]);
+    void checkRegion(const int begin[3], const int count[3]) const;
+    // Whether the symmetry mirrors the map across the plane through node 0 of the axis, and the sign the
+    // mirror applies to the component
+    bool mirroredAxis(int axis) const;
+    double mirrorParity(int component, int axis) const;
+
+    // Symmetry is a policy with a static fold(Point, q, sign): q is the point mapped into the stored domain,
+    // sign the factors that turn the stored field at q into the field at Point
+    template <class Symmetry> void lookupNearest(const G4double Point[4], G4double *Bfield) const;
+    template <class Symmetry> void lookupLinear(const G4double Point[4], G4double *Bfield) const;
+    template <class Symmetry> void lookupCubic(const G4double Point[4], G4double *Bfield) const;
+
+    inline size_t coarseBrick(int i, int j, int k) const {
+        return (static_cast<size_t>(j >> kBrickShift) * nbx + (i >> kBrickShift)) * nbz + (k >> kBrickShift);
+    }
+    inline const FieldBrick& brickAt(int i, int j, int k) const {
+        return fBricks[fBrickIndex[coarseBrick(i, j, k)]];
+    }
+    static inline int brickLocal(int i, int j, int k) {
+        return (((j & kBrickMask) << kBrickShift) + (i & kBrickMask)) * kBrickSize + (k & kBrickMask);
+    }
+
+    // If node (i, j, k) lies in an empty brick, returns the box (in first-quadrant coordinates) over which the
+    // nearest node (cells = false) or all eight cell corners (cells = true) stay inside that brick
+    bool emptyBrickRegion(int i, int j, int k, bool cells, double lo[3], double hi[3]) const;
+
+    // Field in tesla at node (i, j, k)
+    void loadNode(int i, int j, int k, double B[3]) const;
+    // Field in tesla at the 8 corners of the cell with lower corner (i, j, k), corner order as fCornerOffset
+    void loadCell(int i, int j, int k, double Bx[8], double By[8], double Bz[8]) const;
+};
+
+#endif
@@ -1,32 +1,33 @@
 #include "CustomSteppingAction.hh"
 #include "G4Step.hh"
 #include "G4Track.hh"
-#include "G4EventManager.hh"
-#include "G4Event.hh"
 #include "G4SystemOfUnits.hh"
-#include "G4UnitsTable.hh"
-#include "G4RunManager.hh"
 #include "G4ios.hh"
-#include "G4FieldManager.hh"
-#include "G4TransportationManager.hh"
-#include "G4ChordFinder.hh"
-#include "G4MagIntegratorStepper.hh"
-#include "G4Mag_UsualEqRhs.hh"
-#include "G4PropagatorInField.hh"
-#include "G4ClassicalRK4.hh"
 
 
+#include <algorithm>
+#include <array>
 #include <iostream>
+#include <utility>
+
+namespace {
+    // One variant for every combination of the record mode and the four switches
+    constexpr size_t kNumVariants = 3 * 2 * 2 * 2 * 2;
+}
 
 CustomSteppingAction::CustomSteppingAction()
-    : G4UserSteppingAction(), eventManager(G4EventManager::GetEventManager())
+    : G4UserSteppingAction()
 {
     primaryTrackId = 1; // Assume it's one; might need to be changed if more than one primary particles are introduced
     killMomenta = -1;
+    killMomentum2 = 0;
     max_momenta_diff = -1;
     killSecondary = false;
     store_all = false;
     store_primary = false;
+    numKilledInRegions = 0;
+    num_steps = 0;
+    selectVariant();
 }
 
 CustomSteppingAction::~CustomSteppingAction()
@@ -34,114 +35,144 @@ CustomSteppingAction::~CustomSteppingAction()
 
 void CustomSteppingAction::UserSteppingAction(const G4Step* step)
 {
+    (this->*stepFunction)(step);
+}
 
-//    std::cout<<"Hello from the CustomSteppingAction::UserSteppingAction!\n";
-    // Get the track
+template <CustomSteppingAction::RecordMode Record, bool Planes, bool KillSecondary, bool KillMomenta, bool KillInRegions>
+void CustomSteppingAction::steppingVariant(const G4Step* step)
+{
     G4Track* track = step->GetTrack();
-
-    // Get the volume of the current step
-    G4VPhysicalVolume* volume = step->GetPreStepPoint()->GetTouchableHandle()->GetVolume();
-
-    // Get the kinetic energy of the particle
-    G4double kineticEnergy = step->GetPreStepPoint()->GetKineticEnergy();
-
-    // Get the energy deposited in this step
-    G4double edep = step->GetTotalEnergyDeposit();
-
-    // Get the position of the step
-    G4ThreeVector pos = step->GetPostStepPoint()->GetPosition();
-
     num_steps += 1;
 
-    G4StepPoint* preStepPoint = step->GetPreStepPoint();
-    G4ThreeVector positiont = preStepPoint->GetPosition();
-    G4double position[4];  // [Bx, By, Bz, Ex, Ey, Ez]
-    position[0] = positiont[0];
-    position[1] = positiont[1];
-    position[2] = positiont[2];
-
-
-    // Get the global field manager
-    G4FieldManager* fieldManager = G4TransportationManager::GetTransportationManager()->GetFieldManager();
-
-    // Define a vector to hold the field value
-    G4ThreeVector fieldValue;
-
-    G4ThreeVector momentum = track->GetMomentum();
-
-
-
-    if ((store_primary and track->GetTrackID() == primaryTrackId) or store_all) {
-        G4ThreeVector position2 = track->GetPosition();
-
-        // Fill the vectors with current step data
-        px.push_back(momentum.x() / GeV);
-        py.push_back(momentum.y() / GeV);
-        pz.push_back(momentum.z() / GeV);
-
-        x.push_back(position2.x() / m);
-        y.push_back(position2.y() / m);
-        z.push_back(position2.z() / m);
-        trackId.push_back(track->GetTrackID());
-
-        stepLength.push_back(step->GetStepLength() / m);
-        chargeDeposit.push_back(step->GetTotalEnergyDeposit());
+    if (Record != RECORD_NONE) {
+        if (Record == RECORD_ALL || track->GetTrackID() == primaryTrackId) {
+            if (Planes) {
+                recordPlaneCrossings(step);
+            } else {
+                const G4ThreeVector& momentum = track->GetMomentum();
+                const G4ThreeVector& position = track->GetPosition();
+                const double values[StepArena::kNumColumns] = {
+                        momentum.x() / GeV, momentum.y() / GeV, momentum.z() / GeV,
+                        position.x() / m, position.y() / m, position.z() / m,
+                        step->GetStepLength() / m, step->GetTotalEnergyDeposit()};
+                records.push(values, track->GetTrackID());
+            }
+        }
     }
-    if (killSecondary && track->GetTrackID() != primaryTrackId) {
+
+    if (KillSecondary && track->GetTrackID() != primaryTrackId) {
         track->SetTrackStatus(fStopAndKill);
     }
-    else {
 
+    if (KillMomenta && track->GetMomentum().mag2() < killMomentum2) {
+        track->SetTrackStatus(fStopAndKill);
     }
 
-    if (killMomenta > 0) {
-        if (momentum.mag() / GeV < killMomenta) {
-//                std::cout<<"Killing because found moments is "<<momentum.mag() / GeV<<" GeV and to be killed at "<<killMomenta<<"\n";
+    if (KillInRegions && track->GetTrackStatus() != fStopAndKill) {
+        const G4ThreeVector& end = step->GetPostStepPoint()->GetPosition();
+        if (killRegions.contains(end.x(), end.y(), end.z())) {
             track->SetTrackStatus(fStopAndKill);
+            numKilledInRegions += 1;
         }
     }
+}
 
+// Index bits, high to low: record mode (times 16), planes, kill secondary, kill momenta, kill regions
+template <size_t... I>
+std::array<CustomSteppingAction::StepFunction, sizeof...(I)> CustomSteppingAction::makeVariants(std::index_sequence<I...>) {
+    return {{&CustomSteppingAction::steppingVariant<static_cast<RecordMode>(I / 16), (I / 8) % 2 == 1, (I / 4) % 2 == 1,
+                                                    (I / 2) % 2 == 1, I % 2 == 1>...}};
+}
 
-
-
-    // Get the G4ParticleDefinition from the G4Track
-    const G4ParticleDefinition* particleDef = track->GetDefinition();
-
-    // Retrieve the PDG ID
-    G4int pdgID = particleDef->GetPDGEncoding();
-
-    // Now you can use pdgID as needed
-//    std::cout << "XX: " << pdgID << " ";
-
-//   std::cout<<track->GetKineticEnergy()/GeV<<std::endl;
+void CustomSteppingAction::selectVariant() {
+    static const std::array<StepFunction, kNumVariants> variants = makeVariants(std::make_index_sequence<kNumVariants>());
+    RecordMode record = store_all ? RECORD_ALL : (store_primary ? RECORD_PRIMARY : RECORD_NONE);
+    size_t index = static_cast<size_t>(record) * 16 + (!scoringPlanes.empty()) * 8 + killSecondary * 4 +
+                   (killMomenta > 0) * 2 + (!killRegions.empty());
+    stepFunction = variants[index];
 }
 
+void CustomSteppingAction::recordPlaneCrossings(const G4Step* step) {
+    const G4ThreeVector& pre = step->GetPreStepPoint()->GetPosition();
+    const G4ThreeVector& post = step->GetPostStepPoint()->GetPosition();
+    double z0 = pre.z(), z1 = post.z();
+    if (z0 == z1)
+        return;
+
+    // A plane belongs to the step that ends on it, so a step starting on a plane does not record it again
+    auto first = z1 > z0 ? std::upper_bound(scoringPlanes.begin(), scoringPlanes.end(), z0)
+                         : std::lower_bound(scoringPlanes.begin(), scoringPlanes.end(), z1);
+    auto last = z1 > z0 ? std::upper_bound(scoringPlanes.begin(), scoringPlanes.end(), z1)
+                        : std::lower_bound(scoringPlanes.begin(), scoringPlanes.end(), z0);
+    if (first == last)
+        return;
+
+    const G4ThreeVector& p0 = step->GetPreStepPoint()->GetMomentum();
+    const G4ThreeVector& p1 = step->GetPostStepPoint()->GetMomentum();
+    int trackId = step->GetTrack()->GetTrackID();
+    double stepLength = step->GetStepLength() / m;
+    double deposit = step->GetTotalEnergyDeposit();
+    long count = last - first;
+    double tPrevious = 0;
+    for (long k = 0; k < count; ++k) {
+        // Record in the order the track crosses the planes
+        double zPlane = z1 > z0 ? first[k] : last[-1 - k];
+        double t = (zPlane - z0) / (z1 - z0);
+        G4ThreeVector position = pre + t * (post - pre);
+        G4ThreeVector momentum = p0 + t * (p1 - p0);
+        // Each crossing gets the part of the step since the previous one, the last also the rest, so the
+        // lengths and deposits of a step add up to the step once
+        double fraction = (k == count - 1 ? 1.0 : t) - tPrevious;
+        tPrevious = t;
+        const double values[StepArena::kNumColumns] = {
+                momentum.x() / GeV, momentum.y() / GeV, momentum.z() / GeV,
+                position.x() / m, position.y() / m, zPlane / m,
+                fraction * stepLength, fraction * deposit};
+        records.push(values, trackId);
+    }
+}
 
 void CustomSteppingAction::clean() {
-    px.clear();
-    py.clear();
-    pz.clear();
-    x.clear();
-    y.clear();
-    z.clear();
-    stepLength.clear();
-    chargeDeposit.clear();
-    trackId.clear();
+    records.reset();
+    numKilledInRegions = 0;
 //    std::cout<<"Cleaning!"<<std::endl;
 }
 
 void CustomSteppingAction::setKillMomenta(double killMomenta) {
     CustomSteppingAction::killMomenta = killMomenta;
+    killMomentum2 = killMomenta > 0 ? (killMomenta * GeV) * (killMomenta * GeV) : 0;
+    selectVariant();
 }
 
 void CustomSteppingAction::setKillSecondary(bool killSecondary) {
     CustomSteppingAction::killSecondary = killSecondary;
+    selectVariant();
+}
+
+void CustomSteppingAction::setScoringPlanes(std::vector<double> zPlanes) {
+    for (double& z : zPlanes) {
+        z *= m;
+    }
+    std::sort(zPlanes.begin(), zPlanes.end());
+    scoringPlanes = std::move(zPlanes);
+    selectVariant();
+}
+
+void CustomSteppingAction::setKillRegions(const KillRegions& killRegions) {
+    CustomSteppingAction::killRegions = killRegions;
+    selectVariant();
+}
+
+long CustomSteppingAction::getNumKilledInRegions() const {
+    return numKilledInRegions;
 }
 
 void CustomSteppingAction::setStoreAll(bool storeAll) {
     store_all = storeAll;
+    selectVariant();
 }
 
 void CustomSteppingAction::setStorePrimary(bool storePrimary) {
     store_primary = storePrimary;
+    selectVariant();
 }
@@ -3,11 +3,17 @@
 
 #include "G4UserSteppingAction.hh"
 #include "globals.hh"
+#include "StepArena.hh"
+#include "KillRegions.hh"
+#include <array>
+#include <utility>
+#include <vector>
 
 class G4Step;
-class G4EventManager;
-class G4Event;
 
+// Records and kills tracks as configured. Every combination of settings has its own stepping function,
+// instantiated from steppingVariant() with the settings as template parameters, so a step only does the work
+// the current configuration needs. The setters pick the matching variant; call them between runs only.
 class CustomSteppingAction : public G4UserSteppingAction
 {
 public:
@@ -17,34 +23,42 @@ public:
     virtual void UserSteppingAction(const G4Step* step);
     void clean();
 
+    enum RecordMode { RECORD_NONE, RECORD_PRIMARY, RECORD_ALL };
+
 private:
-    G4EventManager* eventManager;
-    G4Event* event;
+    using StepFunction = void (CustomSteppingAction::*)(const G4Step*);
+
     int primaryTrackId;
 
     double killMomenta;
+    // killMomenta squared, in Geant4 units
+    double killMomentum2;
     bool killSecondary;
 
     bool store_all;
     bool store_primary;
 
-public:
-    // Add any necessary members here
-    std::vector<double> px;
+    // z of the virtual scoring planes in mm, ascending
+    std::vector<double> scoringPlanes;
 
-    void setStorePrimary(bool storePrimary);
+    KillRegions killRegions;
+    // Tracks stopped by the kill regions in the current event
+    long numKilledInRegions;
 
-    std::vector<double> py;
-    std::vector<double> pz;
+    StepFunction stepFunction;
 
-    std::vector<double> x;
-    std::vector<double> y;
-    std::vector<double> z;
+    template <RecordMode Record, bool Planes, bool KillSecondary, bool KillMomenta, bool KillInRegions>
+    void steppingVariant(const G4Step* step);
+    template <size_t... I>
+    static std::array<StepFunction, sizeof...(I)> makeVariants(std::index_sequence<I...>);
+    void selectVariant();
+    void recordPlaneCrossings(const G4Step* step);
 
-    std::vector<double> stepLength;
-    std::vector<double> chargeDeposit;
-    std::vector<int> trackId;
+public:
+    // Steps stored during the current event, emptied (capacity kept) by clean()
+    StepArena records;
 
+    void setStorePrimary(bool storePrimary);
 
     void setStoreAll(bool storeAll);
 
@@ -54,6 +68,16 @@ public:
 
     void setKillSecondary(bool killSecondary);
 
+    // z positions (m) of virtual scoring planes. When set, the stored tracks record one entry per plane
+    // crossing instead of every step: position and momentum interpolated to the plane, plus the length and
+    // deposit of the crossing step. A step crossing several planes shares its length and deposit among them
+    // by the interpolated distance, the last crossing taking the rest of the step.
+    void setScoringPlanes(std::vector<double> zPlanes);
+
+    // Tracks whose step ends inside a kill region are stopped there
+    void setKillRegions(const KillRegions& killRegions);
+    long getNumKilledInRegions() const;
+
     double max_momenta_diff; // Only for debugging...
 
 public:
@@ -0,0 +1,147 @@
+#include "DetectorBundle.hh"
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    const char kBundleMagic[8] = {'M', 'U', 'S', 'B', 'N', 'D', 'L', '1'};
+    const char* kAxisRanges[3] = {"range_x", "range_y", "range_z"};
+
+    uint32_t nodesAlong(const double range[3]) {
+        return static_cast<uint32_t>(std::round((range[1] - range[0]) / range[2])) + 1;
+    }
+
+    // On failure the staging file is closed and removed
+    void writeAll(FILE* file, const void* data, size_t bytes, const std::string& staging, const std::string& path) {
+        if (bytes > 0 && std::fwrite(data, 1, bytes, file) != bytes) {
+            std::fclose(file);
+            std::remove(staging.c_str());
+            throw std::runtime_error("Cannot write detector bundle " + path + ".");
+        }
+    }
+}
+
+void DetectorBundle::write(const std::string& path, const Json::Value& detectorData, const FieldMapBuffer& field) {
+    BundleHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kBundleMagic, sizeof(kBundleMagic));
+    header.version = kVersion;
+    header.float32 = field.isFloat32 ? 1 : 0;
+
+    const Json::Value& fieldMap = detectorData["global_field_map"];
+    size_t numNodes = 1;
+    for (int a = 0; a < 3; ++a) {
+        const Json::Value& range = fieldMap[kAxisRanges[a]];
+        if (range.size() != 3 || range[2].asDouble() <= 0) {
+            throw std::runtime_error(std::string("Detector bundle needs global_field_map ") + kAxisRanges[a] +
+                                     " as [min, max, spacing].");
+        }
+        for (int c = 0; c < 3; ++c) {
+            header.ranges[a][c] = range[c].asDouble();
+        }
+        header.numNodes[a] = nodesAlong(header.ranges[a]);
+        numNodes *= header.numNodes[a];
+    }
+    if (field.size != 3 * numNodes) {
+        throw std::runtime_error("Field map has " + std::to_string(field.size / 3) + " nodes, grid expects " +
+                                 std::to_string(numNodes));
+    }
+
+    Json::StreamWriterBuilder writer;
+    writer["indentation"] = "";
+    std::string json = Json::writeString(writer, detectorData);
+    header.jsonOffset = sizeof(BundleHeader);
+    header.jsonBytes = json.size();
+    header.payloadOffset = (header.jsonOffset + header.jsonBytes + kBundleAlignment - 1) / kBundleAlignment * kBundleAlignment;
+    header.payloadBytes = field.size * (field.isFloat32 ? sizeof(float) : sizeof(double));
+
+    // Written under a temporary name and renamed, readers never map a half-written bundle
+    std::string staging = path + ".tmp" + std::to_string(getpid());
+    FILE* file = std::fopen(staging.c_str(), "wb");
+    if (file == nullptr) {
+        throw std::runtime_error("Cannot open detector bundle " + staging + " for writing.");
+    }
+    writeAll(file, &header, sizeof(header), staging, path);
+    writeAll(file, json.data(), json.size(), staging, path);
+    std::vector<char> padding(header.payloadOffset - header.jsonOffset - header.jsonBytes, 0);
+    writeAll(file, padding.data(), padding.size(), staging, path);
+    writeAll(file, field.data, header.payloadBytes, staging, path);
+    if (std::fclose(file) != 0 || std::rename(staging.c_str(), path.c_str()) != 0) {
+        std::remove(staging.c_str());
+        throw std::runtime_error("Cannot finish detector bundle " + path + ".");
+    }
+}
+
+void DetectorBundle::load(const std::string& path, Json::Value& detectorData, FieldMapBuffer& field) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open detector bundle " + path + ": " + std::strerror(errno));
+    }
+    // The mapping stays valid after the descriptor is closed
+    std::unique_ptr<int, void (*)(int*)> closer(&fd, [](int* descriptor) { close(*descriptor); });
+
+    struct stat info;
+    BundleHeader header;
+    if (fstat(fd, &info) != 0 || pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+        std::memcmp(header.magic, kBundleMagic, sizeof(kBundleMagic)) != 0) {
+        throw std::runtime_error("Not a detector bundle: " + path);
+    }
+    if (header.version != kVersion) {
+        throw std::runtime_error("Detector bundle " + path + " has version " + std::to_string(header.version) +
+                                 ", expected " + std::to_string(kVersion));
+    }
+    const size_t valueBytes = header.float32 ? sizeof(float) : sizeof(double);
+    const size_t numValues = 3 * static_cast<size_t>(header.numNodes[0]) * header.numNodes[1] * header.numNodes[2];
+    if (header.payloadOffset % kBundleAlignment != 0 || header.payloadBytes != numValues * valueBytes ||
+        header.payloadOffset + header.payloadBytes > static_cast<uint64_t>(info.st_size) ||
+        header.jsonOffset + header.jsonBytes > header.payloadOffset) {
+        throw std::runtime_error("Detector bundle " + path + " is truncated or corrupt.");
+    }
+
+    std::string json(header.jsonBytes, '\0');
+    if (pread(fd, &json[0], json.size(), static_cast<off_t>(header.jsonOffset)) != static_cast<ssize_t>(json.size())) {
+        throw std::runtime_error("Cannot read the detector JSON of bundle " + path + ".");
+    }
+    Json::CharReaderBuilder readerBuilder;
+    std::unique_ptr<Json::CharReader> reader(readerBuilder.newCharReader());
+    std::string errs;
+    if (!reader->parse(json.data(), json.data() + json.size(), &detectorData, &errs)) {
+        throw std::runtime_error("Failed to parse the detector JSON of bundle " + path + ": " + errs);
+    }
+
+    Json::Value& fieldMap = detectorData["global_field_map"];
+    for (int a = 0; a < 3; ++a) {
+        fieldMap[kAxisRanges[a]] = Json::Value(Json::arrayValue);
+        for (int c = 0; c < 3; ++c) {
+            fieldMap[kAxisRanges[a]].append(header.ranges[a][c]);
+        }
+    }
+    if (!fieldMap.isMember("storage")) {
+        fieldMap["storage"] = "external";
+    }
+
+    field = FieldMapBuffer();
+    if (header.payloadBytes == 0) {
+        return;
+    }
+    void* mapped = mmap(nullptr, header.payloadBytes, PROT_READ, MAP_SHARED, fd, static_cast<off_t>(header.payloadOffset));
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("Cannot map the field of detector bundle " + path + ": " + std::strerror(errno));
+    }
+    size_t bytes = header.payloadBytes;
+    field.data = mapped;
+    field.size = numValues;
+    field.isFloat32 = header.float32 != 0;
+    field.readOnly = true;
+    field.owner = std::shared_ptr<const void>(mapped, [bytes](const void* address) {
+        munmap(const_cast<void*>(address), bytes);
+    });
+}
@@ -0,0 +1,44 @@
+#ifndef DETECTORBUNDLE_HH
+#define DETECTORBUNDLE_HH
+
+#include <cstdint>
+#include <string>
+#include "json/json.h"
+#include "CustomMagneticField.hh"
+
+// Single-file detector bundle: the detector JSON, the field map grid and the field map itself.
+//
+// File: BundleHeader, the detector JSON (jsonBytes), zero padding, then from payloadOffset (a multiple of
+//       kBundleAlignment) the field values, 3 per node in the map's flat order j*(nx*nz)+i*nz+k, float32 or
+//       float64.
+//
+// The payload is mapped read-only, not read: pages come in on first access and are shared through the page
+// cache by every process on the node that maps the same file.
+namespace DetectorBundle {
+    const uint32_t kVersion = 1;
+    const uint64_t kBundleAlignment = 4096;
+
+    struct BundleHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t float32;
+        uint64_t jsonOffset;
+        uint64_t jsonBytes;
+        uint64_t payloadOffset;
+        uint64_t payloadBytes;
+        uint32_t numNodes[3];   // x, y, z
+        uint32_t reserved;
+        double ranges[3][3];    // min, max, spacing per axis, in m
+    };
+
+    // Writes detectorData with field as its global_field_map. The grid comes from the JSON's
+    // global_field_map range_x/y/z, field must have 3 values per node of it.
+    void write(const std::string& path, const Json::Value& detectorData, const FieldMapBuffer& field);
+
+    // Reads the detector JSON and maps the field. The returned buffer keeps the mapping alive. The grid
+    // ranges are written back into the JSON's global_field_map, and its storage defaults to "external"
+    // so the map is read in place instead of being copied.
+    void load(const std::string& path, Json::Value& detectorData, FieldMapBuffer& field);
+}
+
+#endif
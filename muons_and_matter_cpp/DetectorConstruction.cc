@@ -34,13 +34,13 @@
 #include <iostream>
 
 DetectorConstruction::DetectorConstruction(Json::Value detectoData)
-        : G4VUserDetectorConstruction()
+        : G4VUserDetectorConstruction(), magField(nullptr), worldLogicalVolume(nullptr)
 {
     this->detectorData = detectoData;
 }
 
 DetectorConstruction::DetectorConstruction()
-: G4VUserDetectorConstruction()
+: G4VUserDetectorConstruction(), magField(nullptr), worldLogicalVolume(nullptr)
 {
     this->detectorData = Json::Value();
 }
@@ -116,29 +116,31 @@ G4VPhysicalVolume* DetectorConstruction::Construct() {
     // Define the uniform magnetic field
     G4ThreeVector fieldValue = G4ThreeVector(1*tesla, 0., 0.);
     magField = new G4UniformMagField(fieldValue);
+    worldLogicalVolume = logicWorld;
+
+
+
+    // Return the physical world
+    return physWorld;
+}
+
+void DetectorConstruction::ConstructSDandField() {
+    G4MagneticField* field = getMagneticField();
+    if (field == nullptr || worldLogicalVolume == nullptr)
+        return;
 
     // Get the global field manager
     G4FieldManager* fieldManager = G4TransportationManager::GetTransportationManager()->GetFieldManager();
 
     // Set the magnetic field to the field manager
-    fieldManager->SetDetectorField(magField);
-
-
-    // Create the equation of motion and the stepper
-    G4Mag_UsualEqRhs* equationOfMotion = new G4Mag_UsualEqRhs(magField);
-    G4MagIntegratorStepper* stepper = new G4ClassicalRK4(equationOfMotion);
+    fieldManager->SetDetectorField(field);
 
     // Create the chord finder
 //    G4ChordFinder* chordFinder = new G4ChordFinder(magField);
 //    fieldManager->SetChordFinder(chordFinder);
-    fieldManager->CreateChordFinder(magField);
+    fieldManager->CreateChordFinder(field);
 
-    logicWorld->SetFieldManager(fieldManager, true);
-
-
-
-    // Return the physical world
-    return physWorld;
+    worldLogicalVolume->SetFieldManager(fieldManager, true);
 }
 
 void DetectorConstruction::setMagneticFieldValue(double strength, double theta, double phi) {
@@ -149,4 +151,8 @@ void DetectorConstruction::setMagneticFieldValue(double strength, double theta,
 
 double DetectorConstruction::getDetectorWeight() {
     return -1;
-}
\ No newline at end of file
+}
+
+G4MagneticField* DetectorConstruction::getMagneticField() {
+    return magField;
+}
@@ -6,6 +6,7 @@
 #include "G4VPhysicalVolume.hh"
 #include "json/json.h"
 #include "G4UserLimits.hh"
+#include "G4LogicalVolume.hh"
 
 class DetectorConstruction : public G4VUserDetectorConstruction
 {
@@ -15,11 +16,17 @@ public:
     virtual ~DetectorConstruction();
 
     virtual G4VPhysicalVolume* Construct();
+    // Runs on every worker thread (and the master): gives the thread its own field manager and chord finder
+    // for the field built once in Construct()
+    virtual void ConstructSDandField();
     virtual void setMagneticFieldValue(double strength, double theta, double phi);
     virtual G4UserLimits * getLimitsFromDetectorConfig(const Json::Value& detectorData);
     virtual double getDetectorWeight();
+    // Field used for transport, null before the geometry is constructed
+    virtual G4MagneticField* getMagneticField();
 protected:
     G4UniformMagField* magField;
+    G4LogicalVolume* worldLogicalVolume;
     Json::Value detectorData;
 };
 
@@ -0,0 +1,183 @@
+#include "FieldMapIngest.hh"
+#include "ParallelFor.hh"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+namespace {
+    const char* kAxisNames[3] = {"x", "y", "z"};
+
+    // Distinct coordinates along one axis. Chunks are sorted and deduplicated in parallel, a grid has few
+    // distinct values, so merging them is cheap. Values closer than eps count as one.
+    std::vector<double> distinctCoordinates(const double* points, size_t n, int axis, double eps, int numThreads) {
+        std::mutex mutex;
+        std::vector<double> merged;
+        parallelFor(n, numThreads, [&](size_t begin, size_t end) {
+            std::vector<double> chunk(end - begin);
+            for (size_t idx = begin; idx < end; ++idx) {
+                chunk[idx - begin] = points[3 * idx + axis];
+            }
+            std::sort(chunk.begin(), chunk.end());
+            chunk.erase(std::unique(chunk.begin(), chunk.end(), [eps](double a, double b) { return b - a <= eps; }),
+                        chunk.end());
+            std::lock_guard<std::mutex> lock(mutex);
+            merged.insert(merged.end(), chunk.begin(), chunk.end());
+        });
+        std::sort(merged.begin(), merged.end());
+        merged.erase(std::unique(merged.begin(), merged.end(), [eps](double a, double b) { return b - a <= eps; }),
+                     merged.end());
+        return merged;
+    }
+
+    // Groups sorted coordinates into grid lines. A point may sit tolerance x spacing off its node, so values
+    // closer than twice that belong to one line; the widest gap stands in for the spacing, which it is up to
+    // the jitter. Each line is placed at the middle of its values.
+    std::vector<double> gridLines(const std::vector<double>& coordinates, double tolerance) {
+        double widestGap = 0;
+        for (size_t c = 1; c < coordinates.size(); ++c) {
+            widestGap = std::max(widestGap, coordinates[c] - coordinates[c - 1]);
+        }
+        std::vector<double> lines;
+        size_t first = 0;
+        for (size_t c = 1; c <= coordinates.size(); ++c) {
+            if (c == coordinates.size() || coordinates[c] - coordinates[c - 1] > 2 * tolerance * widestGap) {
+                lines.push_back(0.5 * (coordinates[first] + coordinates[c - 1]));
+                first = c;
+            }
+        }
+        return lines;
+    }
+
+    template <class T>
+    void scatter(const double* points, const T* B, size_t n, const double ranges[3][3], const int numNodes[3],
+                 double tolerance, int numThreads, T* out, std::atomic<unsigned char>* seen,
+                 std::atomic<size_t>& badPoint, std::atomic<size_t>& duplicatePoint) {
+        const size_t none = std::numeric_limits<size_t>::max();
+        parallelFor(n, numThreads, [&](size_t begin, size_t end) {
+            for (size_t idx = begin; idx < end; ++idx) {
+                int node[3];
+                bool onGrid = true;
+                for (int a = 0; a < 3; ++a) {
+                    double offset = (points[3 * idx + a] - ranges[a][0]) / ranges[a][2];
+                    node[a] = static_cast<int>(std::lround(offset));
+                    // The grid is fitted to points that are off by up to tolerance themselves
+                    onGrid = onGrid && std::fabs(offset - node[a]) <= 2 * tolerance && node[a] >= 0 && node[a] < numNodes[a];
+                }
+                if (!onGrid) {
+                    size_t expected = none;
+                    badPoint.compare_exchange_strong(expected, idx);
+                    continue;
+                }
+                const size_t target = static_cast<size_t>(node[1]) * (numNodes[0] * numNodes[2]) +
+                                      static_cast<size_t>(node[0]) * numNodes[2] + node[2];
+                if (seen[target].exchange(1) != 0) {
+                    size_t expected = none;
+                    duplicatePoint.compare_exchange_strong(expected, idx);
+                    continue;
+                }
+                out[3 * target] = B[3 * idx];
+                out[3 * target + 1] = B[3 * idx + 1];
+                out[3 * target + 2] = B[3 * idx + 2];
+            }
+        });
+    }
+}
+
+void FieldMapIngest::ingest(const double* points, const void* B, bool BFloat32, size_t n,
+                            const std::string& requestedSymmetry, double tolerance, int numThreads) {
+    if (n == 0) {
+        throw std::runtime_error("Field map has no points.");
+    }
+
+    // Grid along each axis: distinct coordinates, evenly spaced
+    size_t numGridNodes = 1;
+    for (int a = 0; a < 3; ++a) {
+        double lo = std::numeric_limits<double>::infinity(), hi = -lo;
+        for (size_t idx = 0; idx < n; idx += std::max<size_t>(1, n / 4096)) {
+            lo = std::min(lo, points[3 * idx + a]);
+            hi = std::max(hi, points[3 * idx + a]);
+        }
+        // Coordinates this close are the same node even before the spacing is known
+        double eps = 1e-9 * std::max(1.0, std::fabs(lo) + std::fabs(hi));
+        std::vector<double> coordinates = gridLines(distinctCoordinates(points, n, a, eps, numThreads), tolerance);
+        double spacing = coordinates.size() > 1 ? (coordinates.back() - coordinates.front()) / (coordinates.size() - 1) : 1.0;
+        for (size_t c = 1; c < coordinates.size(); ++c) {
+            if (std::fabs(coordinates[c] - coordinates[c - 1] - spacing) > 2 * tolerance * spacing) {
+                throw std::runtime_error(std::string("Field map points are not evenly spaced along ") + kAxisNames[a] +
+                                         ": step " + std::to_string(coordinates[c] - coordinates[c - 1]) + " at " +
+                                         std::to_string(coordinates[c - 1]) + ", mean spacing " + std::to_string(spacing));
+            }
+        }
+        ranges[a][0] = coordinates.front();
+        ranges[a][1] = coordinates.back();
+        ranges[a][2] = spacing;
+        numNodes[a] = static_cast<int>(coordinates.size());
+        numGridNodes *= coordinates.size();
+    }
+    if (numGridNodes != n) {
+        throw std::runtime_error("Field map has " + std::to_string(n) + " points for a " + std::to_string(numNodes[0]) +
+                                 " x " + std::to_string(numNodes[1]) + " x " + std::to_string(numNodes[2]) +
+                                 " grid, nodes are missing or repeated.");
+    }
+
+    // Symmetry from the covered domain
+    bool atOrigin[3];
+    for (int a = 0; a < 3; ++a) {
+        atOrigin[a] = std::fabs(ranges[a][0]) <= tolerance * ranges[a][2];
+    }
+    // An axis starting at 0 within the tolerance starts there exactly, as a mirrored one must
+    for (int a = 0; a < 3; ++a) {
+        if (atOrigin[a] && numNodes[a] > 1) {
+            ranges[a][0] = 0;
+            ranges[a][2] = ranges[a][1] / (numNodes[a] - 1);
+        }
+    }
+    std::string detected = atOrigin[0] ? (atOrigin[1] ? "quadrant" : "x") : "none";
+    if (requestedSymmetry.empty() || requestedSymmetry == "auto") {
+        symmetry = detected;
+    } else {
+        bool fits = requestedSymmetry == "none" || (requestedSymmetry == "x" && atOrigin[0]) ||
+                    (requestedSymmetry == "quadrant" && atOrigin[0] && atOrigin[1]) ||
+                    (requestedSymmetry == "octant" && atOrigin[0] && atOrigin[1] && atOrigin[2]);
+        if (!fits) {
+            throw std::runtime_error("Field map symmetry " + requestedSymmetry + " needs the mirrored axes to start at 0.");
+        }
+        symmetry = requestedSymmetry;
+    }
+
+    // Every point goes to its node, in parallel
+    std::unique_ptr<std::atomic<unsigned char>[]> seen(new std::atomic<unsigned char>[n]);
+    parallelFor(n, numThreads, [&](size_t begin, size_t end) {
+        for (size_t idx = begin; idx < end; ++idx) {
+            seen[idx].store(0, std::memory_order_relaxed);
+        }
+    });
+    const size_t none = std::numeric_limits<size_t>::max();
+    std::atomic<size_t> badPoint(none), duplicatePoint(none);
+    isFloat32 = BFloat32;
+    values.clear();
+    valuesFloat32.clear();
+    if (BFloat32) {
+        valuesFloat32.resize(3 * n);
+        scatter(points, static_cast<const float*>(B), n, ranges, numNodes, tolerance, numThreads, valuesFloat32.data(),
+                seen.get(), badPoint, duplicatePoint);
+    } else {
+        values.resize(3 * n);
+        scatter(points, static_cast<const double*>(B), n, ranges, numNodes, tolerance, numThreads, values.data(),
+                seen.get(), badPoint, duplicatePoint);
+    }
+    if (badPoint != none) {
+        size_t idx = badPoint;
+        throw std::runtime_error("Field map point " + std::to_string(idx) + " (" + std::to_string(points[3 * idx]) + ", " +
+                                 std::to_string(points[3 * idx + 1]) + ", " + std::to_string(points[3 * idx + 2]) +
+                                 ") is off the grid.");
+    }
+    if (duplicatePoint != none) {
+        throw std::runtime_error("Field map point " + std::to_string(static_cast<size_t>(duplicatePoint)) +
+                                 " repeats a grid node.");
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef FIELDMAPINGEST_HH
+#define FIELDMAPINGEST_HH
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Turns a field map given as unordered (point, B) pairs into the layout CustomMagneticField expects: a
+// regular grid described by range_x/y/z = [min, max, spacing] and the values in the flat order
+// j*(nx*nz)+i*nz+k. Every grid node must appear exactly once; points may deviate from their node by
+// tolerance times the spacing. The grid lines are found by clustering the coordinates along each axis.
+//
+// The symmetry follows from the covered domain unless one is asked for: x starting at 0 and y at 0 is
+// "quadrant", x at 0 alone "x", anything else "none". "octant" is never guessed, a map that starts at z = 0
+// is just as often one that ends there, but it is accepted when requested and z starts at 0 too.
+struct FieldMapIngest {
+    double ranges[3][3];    // min, max, spacing per axis, in the units of the points
+    int numNodes[3];
+    std::string symmetry;
+    // 3 values per node, float32 input stays float32
+    std::vector<double> values;
+    std::vector<float> valuesFloat32;
+    bool isFloat32;
+
+    // points: n x 3, B: n x 3 (float32 if BFloat32, else float64). numThreads <= 0 uses all hardware threads.
+    void ingest(const double* points, const void* B, bool BFloat32, size_t n, const std::string& requestedSymmetry,
+                double tolerance, int numThreads);
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include "FieldTracker.hh"
+#include "ParallelFor.hh"
+#include "G4SystemOfUnits.hh"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    // Curvature constant: dp/ds [GeV/c per m] = kappa * q * (u x B[T])
+    constexpr double kappa = 0.299792458;
+}
+
+FieldTracker::FieldTracker(const G4MagneticField* field, const Settings& settings)
+    : fField(field), fSettings(settings) {
+}
+
+void FieldTracker::derivative(const double state[6], double charge, double out[6]) const {
+    G4double point[4] = {state[0] * m, state[1] * m, state[2] * m, 0.0};
+    G4double B[3];
+    fField->GetFieldValue(point, B);
+    const double bx = B[0] / tesla, by = B[1] / tesla, bz = B[2] / tesla;
+
+    const double p = std::sqrt(state[3] * state[3] + state[4] * state[4] + state[5] * state[5]);
+    const double ux = state[3] / p, uy = state[4] / p, uz = state[5] / p;
+    out[0] = ux;
+    out[1] = uy;
+    out[2] = uz;
+    out[3] = kappa * charge * (uy * bz - uz * by);
+    out[4] = kappa * charge * (uz * bx - ux * bz);
+    out[5] = kappa * charge * (ux * by - uy * bx);
+}
+
+void FieldTracker::rk4Step(const double state[6], double charge, double h, double out[6]) const {
+    double k1[6], k2[6], k3[6], k4[6], tmp[6];
+    derivative(state, charge, k1);
+    for (int c = 0; c < 6; ++c) tmp[c] = state[c] + 0.5 * h * k1[c];
+    derivative(tmp, charge, k2);
+    for (int c = 0; c < 6; ++c) tmp[c] = state[c] + 0.5 * h * k2[c];
+    derivative(tmp, charge, k3);
+    for (int c = 0; c < 6; ++c) tmp[c] = state[c] + h * k3[c];
+    derivative(tmp, charge, k4);
+    for (int c = 0; c < 6; ++c) {
+        out[c] = state[c] + (h / 6.0) * (k1[c] + 2 * k2[c] + 2 * k3[c] + k4[c]);
+    }
+}
+
+long FieldTracker::trackOne(const double* particle, double finalState[6], Trajectories* points) const {
+    double state[6];
+    std::copy(particle, particle + 6, state);
+    const double charge = particle[6];
+
+    auto record = [&](const double s[6]) {
+        if (points != nullptr) {
+            points->x.push_back(s[0]);
+            points->y.push_back(s[1]);
+            points->z.push_back(s[2]);
+            points->px.push_back(s[3]);
+            points->py.push_back(s[4]);
+            points->pz.push_back(s[5]);
+        }
+    };
+    record(state);
+
+    const bool moving = state[3] != 0.0 || state[4] != 0.0 || state[5] != 0.0;
+    double h = fSettings.stepLength;
+    long steps = 0;
+    while (moving && steps < fSettings.maxSteps && state[2] <= fSettings.zStop) {
+        double next[6];
+        if (!fSettings.adaptive) {
+            rk4Step(state, charge, h, next);
+        } else {
+            // Compare one full step with two half steps, keep the more accurate result
+            while (true) {
+                double full[6], half[6];
+                rk4Step(state, charge, h, full);
+                rk4Step(state, charge, 0.5 * h, half);
+                rk4Step(half, charge, 0.5 * h, next);
+                const double error = std::sqrt((full[0] - next[0]) * (full[0] - next[0]) + (full[1] - next[1]) * (full[1] - next[1])
+                                               + (full[2] - next[2]) * (full[2] - next[2]));
+                const double scale = (error > 0) ? 0.9 * std::pow(fSettings.tolerance / error, 0.2) : 5.0;
+                if (error <= fSettings.tolerance || h <= fSettings.minStepLength) {
+                    h = std::min(std::max(h * std::min(scale, 5.0), fSettings.minStepLength), fSettings.maxStepLength);
+                    break;
+                }
+                h = std::max(h * std::max(scale, 0.2), fSettings.minStepLength);
+            }
+        }
+        std::copy(next, next + 6, state);
+        steps++;
+        record(state);
+    }
+
+    std::copy(state, state + 6, finalState);
+    return steps;
+}
+
+void FieldTracker::track(const double* particles, size_t n, std::vector<double>& finalStates, std::vector<long>& numSteps,
+                         Trajectories& trajectories) const {
+    finalStates.assign(6 * n, 0.0);
+    numSteps.assign(n, 0);
+
+    // Every thread takes a contiguous range of particles, so its trajectory chunk can be appended in order
+    int numThreads = fSettings.numThreads;
+    if (numThreads <= 0) {
+        numThreads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    const size_t nChunks = std::max<size_t>(1, std::min(static_cast<size_t>(numThreads), n));
+    const size_t chunk = (n + nChunks - 1) / nChunks;
+    std::vector<Trajectories> chunkPoints(fSettings.storeTrajectories ? nChunks : 0);
+
+    parallelFor(nChunks, numThreads, [&](size_t chunkBegin, size_t chunkEnd) {
+        for (size_t c = chunkBegin; c < chunkEnd; ++c) {
+            Trajectories* points = fSettings.storeTrajectories ? &chunkPoints[c] : nullptr;
+            for (size_t idx = c * chunk; idx < std::min((c + 1) * chunk, n); ++idx) {
+                if (points != nullptr) {
+                    points->offsets.push_back(static_cast<long>(points->x.size()));
+                }
+                numSteps[idx] = trackOne(particles + 7 * idx, finalStates.data() + 6 * idx, points);
+            }
+        }
+    });
+
+    trajectories = Trajectories();
+    if (!fSettings.storeTrajectories) {
+        return;
+    }
+    trajectories.offsets.reserve(n + 1);
+    for (Trajectories& points : chunkPoints) {
+        const long shift = static_cast<long>(trajectories.x.size());
+        for (long offset : points.offsets) {
+            trajectories.offsets.push_back(offset + shift);
+        }
+        trajectories.x.insert(trajectories.x.end(), points.x.begin(), points.x.end());
+        trajectories.y.insert(trajectories.y.end(), points.y.begin(), points.y.end());
+        trajectories.z.insert(trajectories.z.end(), points.z.begin(), points.z.end());
+        trajectories.px.insert(trajectories.px.end(), points.px.begin(), points.px.end());
+        trajectories.py.insert(trajectories.py.end(), points.py.begin(), points.py.end());
+        trajectories.pz.insert(trajectories.pz.end(), points.pz.begin(), points.pz.end());
+        points = Trajectories();
+    }
+    trajectories.offsets.push_back(static_cast<long>(trajectories.x.size()));
+}
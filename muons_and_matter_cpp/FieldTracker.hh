@@ -0,0 +1,48 @@
+#ifndef FIELDTRACKER_HH
+#define FIELDTRACKER_HH
+
+#include <vector>
+#include <limits>
+#include "G4MagneticField.hh"
+
+// Propagates charged particles through a G4MagneticField only, no matter and no Geant4 run, by integrating
+// the equation of motion in path length with RK4. Units follow the Python side: m, GeV/c and tesla.
+class FieldTracker {
+public:
+    struct Settings {
+        double stepLength = 0.05;   // Fixed step, or the first step in adaptive mode [m]
+        bool adaptive = false;      // Step doubling error control
+        double tolerance = 1e-5;    // Adaptive mode: allowed position error per step [m]
+        double minStepLength = 1e-4; // Adaptive mode [m]
+        double maxStepLength = 1.0;  // Adaptive mode [m]
+        long maxSteps = 8000;
+        double zStop = std::numeric_limits<double>::infinity(); // Stop once z passes this plane [m]
+        bool storeTrajectories = false;
+        int numThreads = 0;         // <= 0 uses all hardware threads
+    };
+
+    // Trajectory points of all particles back to back, the points of particle n are [offsets[n], offsets[n+1])
+    struct Trajectories {
+        std::vector<double> x, y, z, px, py, pz;
+        std::vector<long> offsets;
+    };
+
+    FieldTracker(const G4MagneticField* field, const Settings& settings);
+
+    // particles: n rows of x, y, z [m], px, py, pz [GeV/c], charge.
+    // finalStates receives n rows of x, y, z, px, py, pz, numSteps receives the accepted steps per particle.
+    void track(const double* particles, size_t n, std::vector<double>& finalStates, std::vector<long>& numSteps,
+               Trajectories& trajectories) const;
+
+private:
+    const G4MagneticField* fField;
+    Settings fSettings;
+
+    // d(state)/ds for state (x, y, z, px, py, pz)
+    void derivative(const double state[6], double charge, double out[6]) const;
+    void rk4Step(const double state[6], double charge, double h, double out[6]) const;
+    // Tracks one particle; points, when not null, receives every accepted state
+    long trackOne(const double* particle, double finalState[6], Trajectories* points) const;
+};
+
+#endif
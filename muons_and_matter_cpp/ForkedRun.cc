@@ -0,0 +1,162 @@
+#include "ForkedRun.hh"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+    const uint64_t kRecordsMagic = 0x4d55534c41425333ULL; // "MUSLABS3"
+
+    struct RecordsHeader {
+        uint64_t magic;
+        uint64_t numEvents;
+        uint64_t numSteps;
+        uint64_t numTrackStarts;
+        uint64_t float32;
+    };
+
+    template <class T>
+    char* writeColumn(char* out, const std::vector<T>& column) {
+        if (!column.empty())
+            std::memcpy(out, column.data(), column.size() * sizeof(T));
+        return out + column.size() * sizeof(T);
+    }
+
+    template <class T>
+    const char* readColumn(const char* in, size_t count, std::vector<T>& column) {
+        column.resize(count);
+        if (count > 0)
+            std::memcpy(column.data(), in, count * sizeof(T));
+        return in + count * sizeof(T);
+    }
+
+    size_t recordsBytes(const RecordsHeader& header) {
+        size_t valueBytes = header.float32 ? sizeof(float) : sizeof(double);
+        return sizeof(RecordsHeader) + (2 * header.numEvents + 1 + header.numTrackStarts) * sizeof(long) +
+               header.numSteps * (StepArena::kNumColumns * valueBytes + sizeof(int));
+    }
+
+    // Layout: header, event offsets, killed tracks per event, the value columns in StepArena order, track ids,
+    // track starts
+    bool writeRecords(int fd, const RunRecords& records) {
+        RecordsHeader header = {kRecordsMagic, records.offsets.size() - 1, records.size(), records.trackStarts().size(),
+                                records.isFloat32() ? 1u : 0u};
+        size_t bytes = recordsBytes(header);
+        if (ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+            return false;
+        void* mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+            return false;
+
+        char* out = static_cast<char*>(mapped);
+        std::memcpy(out, &header, sizeof(header));
+        out += sizeof(header);
+        out = writeColumn(out, records.offsets);
+        out = writeColumn(out, records.killedTracks);
+        for (int c = 0; c < StepArena::kNumColumns; ++c) {
+            out = header.float32 ? writeColumn(out, records.floatColumn(c)) : writeColumn(out, records.doubleColumn(c));
+        }
+        out = writeColumn(out, records.trackIds());
+        writeColumn(out, records.trackStarts());
+        munmap(mapped, bytes);
+        return true;
+    }
+
+    bool readRecords(int fd, RunRecords& records) {
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(RecordsHeader))
+            return false;
+        size_t bytes = static_cast<size_t>(info.st_size);
+        void* mapped = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+            return false;
+
+        const char* in = static_cast<const char*>(mapped);
+        RecordsHeader header;
+        std::memcpy(&header, in, sizeof(header));
+        bool valid = header.magic == kRecordsMagic && recordsBytes(header) == bytes;
+        if (valid) {
+            records.clear();
+            records.setFloat32(header.float32 != 0);
+            in += sizeof(header);
+            in = readColumn(in, header.numEvents + 1, records.offsets);
+            in = readColumn(in, header.numEvents, records.killedTracks);
+            for (int c = 0; c < StepArena::kNumColumns; ++c) {
+                in = header.float32 ? readColumn(in, header.numSteps, records.floatColumn(c))
+                                    : readColumn(in, header.numSteps, records.doubleColumn(c));
+            }
+            in = readColumn(in, header.numSteps, records.trackIds());
+            readColumn(in, header.numTrackStarts, records.trackStarts());
+        }
+        munmap(mapped, bytes);
+        return valid;
+    }
+}
+
+bool runForked(size_t numShards, const std::function<void(size_t, RunRecords&)>& runShard,
+               std::vector<RunRecords>& results, std::string& error) {
+    results.assign(numShards, RunRecords());
+    std::vector<int> fds(numShards, -1);
+    std::vector<pid_t> pids(numShards, -1);
+
+    // Anything still buffered would otherwise be printed once by every child
+    std::cout.flush();
+    std::cerr.flush();
+    std::fflush(nullptr);
+
+    for (size_t shard = 0; shard < numShards && error.empty(); ++shard) {
+        fds[shard] = memfd_create("muon_slabs_shard", MFD_CLOEXEC);
+        if (fds[shard] < 0) {
+            error = std::string("memfd_create failed: ") + std::strerror(errno);
+            break;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            error = std::string("fork failed: ") + std::strerror(errno);
+            break;
+        }
+        if (pid == 0) {
+            int status = 0;
+            try {
+                RunRecords records;
+                runShard(shard, records);
+                if (!writeRecords(fds[shard], records))
+                    status = 2;
+            } catch (const std::exception& e) {
+                std::cerr << "Shard " << shard << " failed: " << e.what() << std::endl;
+                status = 1;
+            } catch (...) {
+                status = 1;
+            }
+            std::cout.flush();
+            std::cerr.flush();
+            std::fflush(nullptr);
+            // Skip atexit handlers and static destructors, they belong to the parent
+            _exit(status);
+        }
+        pids[shard] = pid;
+    }
+
+    for (size_t shard = 0; shard < numShards; ++shard) {
+        if (pids[shard] > 0) {
+            int status = 0;
+            while (waitpid(pids[shard], &status, 0) < 0 && errno == EINTR) {
+            }
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                if (error.empty())
+                    error = "Worker for shard " + std::to_string(shard) + " failed.";
+            } else if (!readRecords(fds[shard], results[shard]) && error.empty()) {
+                error = "Could not read the records of shard " + std::to_string(shard) + ".";
+            }
+        }
+        if (fds[shard] >= 0)
+            close(fds[shard]);
+    }
+    return error.empty();
+}
@@ -0,0 +1,17 @@
+#ifndef FORKEDRUN_HH
+#define FORKEDRUN_HH
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "CustomEventAction.hh"
+
+// Runs numShards shards of work in forked child processes, all at once. The children share the parent's
+// memory (geometry, physics tables, field map) copy-on-write. Each child calls runShard(shard, records) and
+// hands the records back through an anonymous shared memory file, which the parent reads once the child
+// has exited. The caller must not have other threads running (e.g. a tasking run manager's workers).
+// Returns false and sets error if any child failed.
+bool runForked(size_t numShards, const std::function<void(size_t, RunRecords&)>& runShard,
+               std::vector<RunRecords>& results, std::string& error);
+
+#endif
@@ -0,0 +1,65 @@
+#include "KillRegions.hh"
+#include <limits>
+#include <stdexcept>
+#include "G4SystemOfUnits.hh"
+
+namespace {
+    void readZRange(const Json::Value& region, KillRegions::Region& out) {
+        const Json::Value& range = region["z_range"];
+        if (!range.isArray() || range.size() != 2)
+            throw std::runtime_error("Kill region needs a z_range of two values.");
+        out.min[2] = range[0].asDouble() * m;
+        out.max[2] = range[1].asDouble() * m;
+    }
+}
+
+KillRegions::KillRegions() {
+}
+
+KillRegions::KillRegions(const Json::Value& regions) {
+    const double infinity = std::numeric_limits<double>::infinity();
+    for (const Json::Value& region : regions) {
+        Region out;
+        out.outside = region.get("outside", false).asBool();
+        out.centerX = out.centerY = 0;
+        out.radius2 = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            out.min[axis] = -infinity;
+            out.max[axis] = infinity;
+        }
+
+        std::string type = region["type"].asString();
+        if (type == "box") {
+            const Json::Value& center = region["center"];
+            const Json::Value& halfSize = region["half_size"];
+            if (center.size() != 3 || halfSize.size() != 3)
+                throw std::runtime_error("Box kill region needs a center and half_size of three values.");
+            out.shape = BOX;
+            for (int axis = 0; axis < 3; ++axis) {
+                out.min[axis] = (center[axis].asDouble() - halfSize[axis].asDouble()) * m;
+                out.max[axis] = (center[axis].asDouble() + halfSize[axis].asDouble()) * m;
+            }
+        } else if (type == "cylinder") {
+            const Json::Value& center = region["center"];
+            if (center.size() != 2)
+                throw std::runtime_error("Cylinder kill region needs a center of two values (x, y).");
+            out.shape = CYLINDER;
+            out.centerX = center[0].asDouble() * m;
+            out.centerY = center[1].asDouble() * m;
+            double radius = region["radius"].asDouble() * m;
+            out.radius2 = radius * radius;
+            out.min[0] = out.centerX - radius;
+            out.max[0] = out.centerX + radius;
+            out.min[1] = out.centerY - radius;
+            out.max[1] = out.centerY + radius;
+            if (region.isMember("z_range"))
+                readZRange(region, out);
+        } else if (type == "z_window") {
+            out.shape = Z_WINDOW;
+            readZRange(region, out);
+        } else {
+            throw std::runtime_error("Unknown kill region type: " + type);
+        }
+        fRegions.push_back(out);
+    }
+}
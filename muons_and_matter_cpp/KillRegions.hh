@@ -0,0 +1,59 @@
+#ifndef KILLREGIONS_HH
+#define KILLREGIONS_HH
+
+#include <vector>
+#include "json/json.h"
+
+// Regions of space in which tracks are stopped, read from the "kill_regions" list of the detector JSON:
+//   {"type": "box", "center": [x, y, z], "half_size": [dx, dy, dz]}
+//   {"type": "cylinder", "center": [x, y], "radius": r, "z_range": [z0, z1]}   (axis along z, z_range optional)
+//   {"type": "z_window", "z_range": [z0, z1]}
+// Lengths in m. "outside": true turns a region around and kills everything not in it, which is how an
+// acceptance is expressed. Positions passed to contains() are in Geant4 units (mm).
+class KillRegions {
+public:
+    enum Shape { BOX, CYLINDER, Z_WINDOW };
+
+    struct Region {
+        Shape shape;
+        bool outside;
+        // Bounding box in mm, the cylinder's is the box around it
+        double min[3];
+        double max[3];
+        double centerX, centerY;
+        double radius2;
+    };
+
+    KillRegions();
+    explicit KillRegions(const Json::Value& regions);
+
+    bool empty() const { return fRegions.empty(); }
+    size_t size() const { return fRegions.size(); }
+
+    // x, y, z in mm
+    inline bool contains(double x, double y, double z) const {
+        for (const Region& region : fRegions) {
+            if (inside(region, x, y, z) != region.outside)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    std::vector<Region> fRegions;
+
+    static inline bool inside(const Region& region, double x, double y, double z) {
+        if (z < region.min[2] || z > region.max[2])
+            return false;
+        if (region.shape == Z_WINDOW)
+            return true;
+        if (x < region.min[0] || x > region.max[0] || y < region.min[1] || y > region.max[1])
+            return false;
+        if (region.shape == BOX)
+            return true;
+        double dx = x - region.centerX, dy = y - region.centerY;
+        return dx * dx + dy * dy <= region.radius2;
+    }
+};
+
+#endif
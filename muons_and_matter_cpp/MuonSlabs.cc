@@ -8,18 +8,30 @@
 #include "G4ParticleDefinition.hh"
 #include "G4ProcessManager.hh"
 #include "G4RunManager.hh"
+#include "G4RunManagerFactory.hh"
 #include "CustomSteppingAction.hh"
 #include "DetectorConstruction.hh"
 #include "G4UImanager.hh"
-#include "PrimaryGeneratorAction.cc"
+#include "PrimaryGeneratorAction.hh"
 #include "FTFP_BERT.hh"
 #include "CustomEventAction.hh"
+#include "ActionInitialization.hh"
 #include "ToyDetectorConstruction.hh"
+#include "ParallelFor.hh"
+#include "ForkedRun.hh"
+#include "StepFile.hh"
+#include "FieldTracker.hh"
+#include "PhysicsTableCache.hh"
+#include "TransportPhysicsList.hh"
+#include "DetectorBundle.hh"
+#include "FieldMapIngest.hh"
+#include "G4SystemOfUnits.hh"
 #include <pybind11/numpy.h>
 #include <pybind11/stl.h>
 #include <G4UIExecutive.hh>
 #include "QGSP_BERT.hh"
 #include "json/json.h"
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <stdexcept> // For standard exceptions like std::runtime_error
@@ -31,12 +43,17 @@ using namespace py::literals;
 
 G4RunManager* runManager;
 G4UImanager *ui_manager;
-PrimaryGeneratorAction *primariesGenerator;
 DetectorConstruction * detector;
-CustomSteppingAction * steppingAction;
 //bool collect_full_data;
 CLHEP::MTwistEngine *randomEngine;
-CustomEventAction *customEventAction;
+// Builds the per-thread generator, stepping and event actions; owns the primary queue and the event records
+ActionInitialization *actionInitialization;
+// Steps of the last simulate_muon run, returned by collect()
+RunRecords lastRunRecords;
+// Step file opened by open_output(), every simulated event is appended to it until close_output()
+std::unique_ptr<StepFileWriter> outputWriter;
+// Seeds given to initialize(), forked workers derive theirs from them
+long baseSeeds[4];
 
 
 
@@ -44,160 +61,476 @@ int add(int a, int b) {
     return a + b;
 }
 
-void simulate_muon(double px, double py, double pz, int charge,
-                    double x, double y, double z) {
-    if (ui_manager == nullptr) {
+void check_initialized() {
+    if (runManager == nullptr) {
         G4cout<<"Call initialize(...) before running this function.\n";
         throw std::runtime_error("Forgot to call initialize?");
     }
-    primariesGenerator->setNextMomenta(px, py, pz);
-    primariesGenerator->setNextPosition(x, y, z);
-    primariesGenerator->setNextCharge(charge);
-    ui_manager->ApplyCommand(std::string("/run/beamOn ") + std::to_string(1));
 }
 
-py::dict collect_from_sensitive() {
-    auto detector2 = dynamic_cast<GDetectorConstruction*>(detector);
-    if (detector2 == nullptr) {
-        throw std::runtime_error("Sensitive film only possible for GDetectorConstruction.");
+// Runs one event per queued primary, on however many threads the run manager has, and gathers the
+// stored steps of all events in event order. Does not touch Python, forked workers call it too.
+// Without record the steps are not kept in memory (they only go to the output file, if one is open) and
+// records is left empty.
+void beam_on_primaries(std::vector<PrimaryGeneratorAction::Primary> queue, RunRecords& records, bool record = true) {
+    size_t n = queue.size();
+    EventRecordStore& store = actionInitialization->getRecordStore();
+    actionInitialization->setPrimaries(std::move(queue));
+    if (record)
+        store.startRecording(n);
+    runManager->BeamOn(static_cast<G4int>(n));
+    actionInitialization->clearPrimaries();
+    if (!record) {
+        records.clear();
+        return;
     }
+    store.stopRecording();
+    if (!store.merge(records)) {
+        throw std::runtime_error("Run ended before all " + std::to_string(n) + " events were processed.");
+    }
+}
 
-    if (detector2->slimFilmSensitiveDetector == nullptr) {
-        throw std::runtime_error("Slim film not installed in the detector.");
+void run_primaries(std::vector<PrimaryGeneratorAction::Primary> queue, RunRecords& records, bool record = true) {
+    check_initialized();
+    py::gil_scoped_release release;
+    beam_on_primaries(std::move(queue), records, record);
+}
+
+std::vector<PrimaryGeneratorAction::Primary> primaries_from_array(
+        const py::array_t<double, py::array::c_style | py::array::forcecast>& muons) {
+    if (muons.ndim() != 2 || muons.shape(1) < 7) {
+        throw std::runtime_error("Muons must be an (N, 7) array of x, y, z, px, py, pz, charge.");
+    }
+    size_t n = muons.shape(0);
+    auto rows = muons.unchecked<2>();
+    std::vector<PrimaryGeneratorAction::Primary> queue(n);
+    for (size_t idx = 0; idx < n; ++idx) {
+        queue[idx] = {rows(idx, 0), rows(idx, 1), rows(idx, 2), rows(idx, 3), rows(idx, 4), rows(idx, 5),
+                      static_cast<int>(rows(idx, 6))};
     }
+    return queue;
+}
 
-    std::vector<double>& px = detector2->slimFilmSensitiveDetector->px;
-    std::vector<double>& py = detector2->slimFilmSensitiveDetector->py;
-    std::vector<double>& pz = detector2->slimFilmSensitiveDetector->pz;
+// Hands the vector's buffer to a numpy array without copying any element; a capsule owns it from then on.
+// values is left empty. An empty shape gives a 1-d array.
+template <class T>
+py::array_t<T> to_numpy(std::vector<T>&& values, std::vector<size_t> shape = {}) {
+    auto owned = new std::vector<T>(std::move(values));
+    values = std::vector<T>();
+    if (shape.empty())
+        shape.push_back(owned->size());
+    py::capsule owner(owned, [](void* buffer) { delete static_cast<std::vector<T>*>(buffer); });
+    return py::array_t<T>(shape, owned->data(), owner);
+}
 
-    std::vector<double>& x = detector2->slimFilmSensitiveDetector->x;
-    std::vector<double>& y = detector2->slimFilmSensitiveDetector->y;
-    std::vector<double>& z = detector2->slimFilmSensitiveDetector->z;
-    std::vector<int>& trackId = detector2->slimFilmSensitiveDetector->trackId;
-    std::vector<int>& pdgid = detector2->slimFilmSensitiveDetector->pid;
+// Moves the step columns of an arena into numpy arrays, float32 or float64 as stored; the arena is empty
+// afterwards. track_starts holds the index of the first step of every track.
+py::dict step_arena_to_dict(StepArena& arena) {
+    py::dict d;
+    for (int c = 0; c < StepArena::kNumColumns; ++c) {
+        if (arena.isFloat32())
+            d[StepArena::columnName(c)] = to_numpy(std::move(arena.floatColumn(c)));
+        else
+            d[StepArena::columnName(c)] = to_numpy(std::move(arena.doubleColumn(c)));
+    }
+    d["track_id"] = to_numpy(std::move(arena.trackIds()));
+    d["track_starts"] = to_numpy(std::move(arena.trackStarts()));
+    return d;
+}
 
+// Moves the columns of records into numpy arrays, records is empty afterwards
+py::dict run_records_to_dict(RunRecords& records) {
+    py::dict d = step_arena_to_dict(records);
+    d["offsets"] = to_numpy(std::move(records.offsets));
+    d["killed_tracks"] = to_numpy(std::move(records.killedTracks));
+    records.clear();
+    return d;
+}
 
-    std::vector<double> px_copy(px.begin(), px.end());
-    std::vector<double> py_copy(py.begin(), py.end());
-    std::vector<double> pz_copy(pz.begin(), pz.end());
+void simulate_muon(double px, double py, double pz, int charge,
+                    double x, double y, double z) {
+    run_primaries({{x, y, z, px, py, pz, charge}}, lastRunRecords);
+}
 
-    std::vector<double> x_copy(x.begin(), x.end());
-    std::vector<double> y_copy(y.begin(), y.end());
-    std::vector<double> z_copy(z.begin(), z.end());
+// Hits of the sensitive film since the last collection, from all threads. Besides the step columns at the
+// film's entrance, track_id, pdg_id and event_id identify every hit.
+py::dict collect_from_sensitive() {
+    check_initialized();
+    auto toyDetector = dynamic_cast<ToyDetectorConstruction*>(detector);
+    if (toyDetector == nullptr) {
+        throw std::runtime_error("Sensitive film only possible for ToyDetectorConstruction.");
+    }
 
-    std::vector<int> trackId_copy(trackId.begin(), trackId.end());
-    std::vector<int> pdgid_copy(pdgid.begin(), pdgid.end());
+    if (!toyDetector->hasSensitiveFilm()) {
+        throw std::runtime_error("Slim film not installed in the detector.");
+    }
 
-    py::array np_px = py::cast(px_copy);
-    py::array np_py = py::cast(py_copy);
-    py::array np_pz = py::cast(pz_copy);
+    // The hits are copied out, the films keep their buffers for the next run
+    StepArena hits;
+    std::vector<int> pdgIds;
+    std::vector<int> eventIds;
+    toyDetector->collectFilmHits(hits, pdgIds, eventIds);
+    py::dict d = step_arena_to_dict(hits);
+    d["pdg_id"] = to_numpy(std::move(pdgIds));
+    d["event_id"] = to_numpy(std::move(eventIds));
 
-    py::array np_x = py::cast(x_copy);
-    py::array np_y = py::cast(y_copy);
-    py::array np_z = py::cast(z_copy);
+    return d;
+}
 
-    py::array np_trackId = py::cast(trackId_copy);
-    py::array np_pdgId = py::cast(pdgid_copy);
+// Simulates an (N, 7) array of x, y, z [m], px, py, pz [GeV], charge in one run of N events. Returns the
+// stored steps of all muons as flat columns; the steps of muon n are [offsets[n], offsets[n+1]).
+// With collect = false the steps are only written to the output file and the columns come back empty.
+py::dict simulate_muons(py::array_t<double, py::array::c_style | py::array::forcecast> muons, bool collect) {
+    std::vector<PrimaryGeneratorAction::Primary> queue = primaries_from_array(muons);
+    RunRecords records;
+    run_primaries(std::move(queue), records, collect);
+    return run_records_to_dict(records);
+}
 
-    py::dict d = py::dict(
-            "px"_a = np_px,
-            "py"_a = np_py,
-            "pz"_a = np_pz,
-            "x"_a = np_x,
-            "y"_a = np_y,
-            "z"_a = np_z,
-            "track_id"_a = np_trackId,
-            "pdg_id"_a = np_pdgId
-    );
+// Like simulate_muons, but splits the muons into num_workers contiguous shards, each run by a process forked
+// from this one. The workers share the geometry, physics tables and field map copy-on-write instead of
+// initializing again, and seed their engines from the initialize() seeds and their shard index.
+// Needs a sequential run manager (initialize with num_threads = 1).
+py::dict simulate_muons_forked(py::array_t<double, py::array::c_style | py::array::forcecast> muons, int num_workers) {
+    check_initialized();
+    if (runManager->GetRunManagerType() != G4RunManager::sequentialRM) {
+        throw std::runtime_error("Forked workers need a sequential run manager, initialize with num_threads = 1.");
+    }
+    if (outputWriter) {
+        throw std::runtime_error("Forked workers cannot write to the output file, call close_output() first.");
+    }
+    std::vector<PrimaryGeneratorAction::Primary> queue = primaries_from_array(muons);
+    size_t n = queue.size();
+    size_t numShards = std::max<size_t>(1, std::min(static_cast<size_t>(std::max(num_workers, 1)), n));
+    size_t shardSize = n == 0 ? 0 : (n + numShards - 1) / numShards;
+
+    // An empty run builds the physics tables here, before forking, so the workers share them
+    runManager->BeamOn(0);
+
+    std::vector<RunRecords> shardRecords;
+    std::string error;
+    bool ok = runForked(numShards, [&](size_t shard, RunRecords& records) {
+        std::seed_seq seq = {baseSeeds[0], baseSeeds[1], baseSeeds[2], baseSeeds[3], static_cast<long>(shard) + 1};
+        std::vector<uint32_t> derived(4);
+        seq.generate(derived.begin(), derived.end());
+        long seeds[5] = {0, 0, 0, 0, 0};
+        for (int idx = 0; idx < 4; ++idx) {
+            seeds[idx] = static_cast<long>(derived[idx] & 0x7fffffff) + 1; // Zero ends the seed list
+        }
+        G4Random::setTheSeeds(seeds);
+
+        size_t begin = std::min(shard * shardSize, n);
+        size_t end = std::min(begin + shardSize, n);
+        beam_on_primaries(std::vector<PrimaryGeneratorAction::Primary>(queue.begin() + begin, queue.begin() + end), records);
+    }, shardRecords, error);
+    if (!ok) {
+        throw std::runtime_error(error);
+    }
 
-    return d;
+    RunRecords records;
+    records.offsets.push_back(0);
+    for (const RunRecords& shard : shardRecords) {
+        records.appendRun(shard);
+    }
+    return run_records_to_dict(records);
 }
 
+// Hands the steps of the last simulate_muon run to numpy without copying them. The next run starts with fresh
+// buffers; collecting twice without a run in between returns empty arrays.
 py::dict collect() {
+    py::dict d = step_arena_to_dict(lastRunRecords);
+    lastRunRecords.clear();
 
-    std::vector<double>& px = steppingAction->px;
-    std::vector<double>& py = steppingAction->py;
-    std::vector<double>& pz = steppingAction->pz;
-
-    std::vector<double>& x = steppingAction->x;
-    std::vector<double>& y = steppingAction->y;
-    std::vector<double>& z = steppingAction->z;
-    std::vector<int>& trackId = steppingAction->trackId;
+    return d;
+}
 
-    std::vector<double>& stepLength = steppingAction->stepLength;
-    std::vector<double>& chargeDeposit = steppingAction->chargeDeposit;
+// Appends the steps of every following event to a chunked, compressed step file. Compression and writing
+// happen on a background thread; close_output() finishes the file.
+void open_output(const std::string& path, size_t chunk_steps, int compression_level, bool float32) {
+    check_initialized();
+    if (outputWriter) {
+        throw std::runtime_error("An output file is already open, call close_output() first.");
+    }
+    outputWriter.reset(new StepFileWriter(path, float32, chunk_steps, compression_level));
+    actionInitialization->setOutputWriter(outputWriter.get());
+}
 
-    std::vector<double> px_copy(px.begin(), px.end());
-    std::vector<double> py_copy(py.begin(), py.end());
-    std::vector<double> pz_copy(pz.begin(), pz.end());
+py::dict close_output() {
+    if (!outputWriter) {
+        throw std::runtime_error("No output file is open.");
+    }
+    actionInitialization->setOutputWriter(nullptr);
+    std::unique_ptr<StepFileWriter> writer = std::move(outputWriter);
+    {
+        py::gil_scoped_release release;
+        writer->close();
+    }
+    return py::dict("events"_a = writer->getEventsWritten(), "bytes"_a = writer->getBytesWritten());
+}
 
-    std::vector<double> x_copy(x.begin(), x.end());
-    std::vector<double> y_copy(y.begin(), y.end());
-    std::vector<double> z_copy(z.begin(), z.end());
+// Events [begin, end) of a step file, in the layout of simulate_muons plus the event ids
+py::dict read_output(const std::string& path, size_t begin, long end) {
+    StepFileReader reader(path);
+    RunRecords records;
+    std::vector<long> eventIds;
+    reader.readEvents(begin, end < 0 ? reader.getNumEvents() : static_cast<size_t>(end), records, eventIds);
+    py::dict d = run_records_to_dict(records);
+    d["event_ids"] = to_numpy(std::move(eventIds));
+    return d;
+}
 
-    std::vector<double> stepLength_copy(stepLength.begin(), stepLength.end());
-    std::vector<double> chargeDeposit_copy(chargeDeposit.begin(), chargeDeposit.end());
+void set_field_value(double strength, double theta, double phi) {
+    detector->setMagneticFieldValue(strength, theta, phi);
+}
 
-    std::vector<int> trackId_copy(trackId.begin(), trackId.end());
+// Evaluates the transport field at (N, 3) points in m and returns (N, 3) values in tesla
+py::array_t<double> evaluate_field(py::array_t<double, py::array::c_style | py::array::forcecast> points, int num_threads) {
+    if (points.ndim() != 2 || points.shape(1) != 3) {
+        throw std::runtime_error("Points must be an (N, 3) array.");
+    }
+    G4MagneticField* field = detector == nullptr ? nullptr : detector->getMagneticField();
+    if (field == nullptr) {
+        throw std::runtime_error("No magnetic field constructed, call initialize(...) first.");
+    }
 
-    py::array np_px = py::cast(px_copy);
-    py::array np_py = py::cast(py_copy);
-    py::array np_pz = py::cast(pz_copy);
+    size_t n = points.shape(0);
+    py::array_t<double> result({n, size_t(3)});
+    const double* in = points.data();
+    double* out = result.mutable_data();
+    {
+        py::gil_scoped_release release;
+        parallelFor(n, num_threads, [&](size_t begin, size_t end) {
+            for (size_t idx = begin; idx < end; ++idx) {
+                G4double point[4] = {in[3 * idx] * m, in[3 * idx + 1] * m, in[3 * idx + 2] * m, 0.0};
+                G4double B[3];
+                field->GetFieldValue(point, B);
+                out[3 * idx] = B[0] / tesla;
+                out[3 * idx + 1] = B[1] / tesla;
+                out[3 * idx + 2] = B[2] / tesla;
+            }
+        });
+    }
+    return result;
+}
 
-    py::array np_x = py::cast(x_copy);
-    py::array np_y = py::cast(y_copy);
-    py::array np_z = py::cast(z_copy);
+// Tracks an (N, 7) array of x, y, z [m], px, py, pz [GeV], charge through the magnetic field alone, without
+// Geant4 stepping or matter. Returns the final states and, if asked, every trajectory point as flat columns.
+py::dict track_in_field(py::array_t<double, py::array::c_style | py::array::forcecast> particles, double step_length,
+                        long max_steps, bool adaptive, double tolerance, double max_step_length, double z_stop,
+                        bool store_trajectories, int num_threads) {
+    if (particles.ndim() != 2 || particles.shape(1) != 7) {
+        throw std::runtime_error("Particles must be an (N, 7) array of x, y, z, px, py, pz, charge.");
+    }
+    if (step_length <= 0) {
+        throw std::runtime_error("Step length must be positive.");
+    }
+    G4MagneticField* field = detector == nullptr ? nullptr : detector->getMagneticField();
+    if (field == nullptr) {
+        throw std::runtime_error("No magnetic field constructed, call initialize(...) first.");
+    }
 
-    py::array np_stepLength = py::cast(stepLength_copy);
-    py::array np_chargeDeposit = py::cast(chargeDeposit_copy);
-    py::array np_trackId = py::cast(trackId);
+    FieldTracker::Settings settings;
+    settings.stepLength = step_length;
+    settings.maxSteps = max_steps;
+    settings.adaptive = adaptive;
+    settings.tolerance = tolerance;
+    settings.minStepLength = std::min(settings.minStepLength, step_length);
+    settings.maxStepLength = std::max(max_step_length, step_length);
+    settings.zStop = z_stop;
+    settings.storeTrajectories = store_trajectories;
+    settings.numThreads = num_threads;
+    FieldTracker tracker(field, settings);
+
+    size_t n = particles.shape(0);
+    std::vector<double> finalStates;
+    std::vector<long> numSteps;
+    FieldTracker::Trajectories trajectories;
+    {
+        py::gil_scoped_release release;
+        tracker.track(particles.data(), n, finalStates, numSteps, trajectories);
+    }
 
+    py::array final = to_numpy(std::move(finalStates), {n, size_t(6)});
     py::dict d = py::dict(
-            "px"_a = np_px,
-            "py"_a = np_py,
-            "pz"_a = np_pz,
-            "x"_a = np_x,
-            "y"_a = np_y,
-            "z"_a = np_z,
-            "step_length"_a = np_stepLength,
-            "charge_deposit"_a = np_chargeDeposit,
-            "track_id"_a = np_trackId
+            "final"_a = final,
+            "num_steps"_a = to_numpy(std::move(numSteps))
     );
-
+    if (store_trajectories) {
+        d["x"] = to_numpy(std::move(trajectories.x));
+        d["y"] = to_numpy(std::move(trajectories.y));
+        d["z"] = to_numpy(std::move(trajectories.z));
+        d["px"] = to_numpy(std::move(trajectories.px));
+        d["py"] = to_numpy(std::move(trajectories.py));
+        d["pz"] = to_numpy(std::move(trajectories.pz));
+        d["offsets"] = to_numpy(std::move(trajectories.offsets));
+    }
     return d;
 }
 
-void set_field_value(double strength, double theta, double phi) {
-    detector->setMagneticFieldValue(strength, theta, phi);
+py::dict field_cache_stats(bool reset) {
+    auto toyDetector = dynamic_cast<ToyDetectorConstruction*>(detector);
+    if (toyDetector == nullptr || toyDetector->getCustomField() == nullptr) {
+        throw std::runtime_error("Field cache statistics need a ToyDetectorConstruction with a field map.");
+    }
+    CustomMagneticField* field = toyDetector->getCustomField();
+    unsigned long long hits, misses;
+    field->getCacheStatistics(hits, misses);
+    if (reset) {
+        field->resetCacheStatistics();
+    }
+    double total = static_cast<double>(hits + misses);
+    return py::dict("hits"_a = hits, "misses"_a = misses, "hit_rate"_a = total > 0 ? hits / total : 0.0);
 }
 
 void set_kill_momenta(double kill_momenta) {
-    steppingAction->setKillMomenta(kill_momenta);
+    actionInitialization->setKillMomenta(kill_momenta);
 }
 
-std::string initialize( int rseed_0,
-                 int rseed_1, int rseed_2, int rseed_3, std::string detector_specs, py::array_t<double> B) {
-    randomEngine = new CLHEP::MTwistEngine(rseed_0);
-    //#include <chrono>
-    //auto start = std::chrono::high_resolution_clock::now(); 
-    //auto end = std::chrono::high_resolution_clock::now();
-    //std::cout<<"TIME JSON" << std::chrono::duration_cast<std::chrono::seconds>(end - start).count() << std::endl;
+// Wraps the numpy field map without copying it. The view keeps a reference to the array,
+// so the data stays valid for as long as the detector or the field uses it.
+FieldMapBuffer field_map_from_array(py::array B) {
+    bool isFloat32 = B.dtype().is(py::dtype::of<float>());
+    bool isFloat64 = B.dtype().is(py::dtype::of<double>());
+    if (!(isFloat32 || isFloat64) || !(B.flags() & py::array::c_style)) {
+        std::cout << "Field map is not a contiguous float32/float64 array, converting to float64.\n";
+        B = py::array_t<double, py::array::c_style | py::array::forcecast>::ensure(B);
+        if (!B)
+            throw std::runtime_error("Field map cannot be converted to a float64 array.");
+        isFloat32 = false;
+    }
 
+    FieldMapBuffer buffer;
+    buffer.data = B.data();
+    buffer.size = B.size();
+    buffer.isFloat32 = isFloat32;
+    buffer.owner = std::shared_ptr<const void>(new py::array(B), [](py::array* array) {
+        py::gil_scoped_acquire gil;
+        delete array;
+    });
+    return buffer;
+}
 
-    long seeds[4] = {rseed_0, rseed_1, rseed_2, rseed_3};
+template <class T>
+py::array_t<T> field_values_to_array(std::vector<T>&& values) {
+    auto owner = new std::vector<T>(std::move(values));
+    py::capsule free(owner, [](void* vector) { delete static_cast<std::vector<T>*>(vector); });
+    return py::array_t<T>({owner->size() / 3, size_t(3)}, owner->data(), free);
+}
 
-    CLHEP::HepRandom::setTheSeeds(seeds);
-    G4Random::setTheSeeds(seeds);
-    runManager = new G4RunManager;
+// Builds a field map dict for "global_field_map" from (N, 3) points (m) and (N, 3) B (tesla) in any order.
+// The grid, its spacing and the symmetry come from the points; B keeps its precision (float32 or float64).
+py::dict ingest_field_map(py::array_t<double, py::array::c_style | py::array::forcecast> points, py::array B,
+                          std::string symmetry, double tolerance, int num_threads) {
+    if (points.ndim() != 2 || points.shape(1) != 3) {
+        throw std::runtime_error("Points must be an (N, 3) array.");
+    }
+    bool isFloat32 = B.dtype().is(py::dtype::of<float>());
+    if (isFloat32) {
+        B = py::array_t<float, py::array::c_style>::ensure(B);
+    } else {
+        B = py::array_t<double, py::array::c_style | py::array::forcecast>::ensure(B);
+    }
+    if (!B || B.size() != points.size()) {
+        throw std::runtime_error("B must be an (N, 3) array matching the points.");
+    }
+
+    FieldMapIngest ingest;
+    {
+        py::gil_scoped_release release;
+        ingest.ingest(points.data(), B.data(), isFloat32, points.shape(0), symmetry, tolerance, num_threads);
+    }
+    py::array values = isFloat32 ? py::array(field_values_to_array(std::move(ingest.valuesFloat32)))
+                                 : py::array(field_values_to_array(std::move(ingest.values)));
+    auto range = [&](int axis) {
+        return std::vector<double>{ingest.ranges[axis][0], ingest.ranges[axis][1], ingest.ranges[axis][2]};
+    };
+    return py::dict("B"_a = values, "range_x"_a = range(0), "range_y"_a = range(1), "range_z"_a = range(2),
+                    "symmetry"_a = ingest.symmetry);
+}
 
-    // Convert numpy array to std::vector
-    std::vector<double> B_map(B.size());
-    std::memcpy(B_map.data(), B.data(), B.size() * sizeof(double));
+CustomMagneticField* custom_field() {
+    check_initialized();
+    auto toyDetector = dynamic_cast<ToyDetectorConstruction*>(detector);
+    if (toyDetector == nullptr || toyDetector->getCustomField() == nullptr) {
+        throw std::runtime_error("Field map updates need a ToyDetectorConstruction with a field map.");
+    }
+    return toyDetector->getCustomField();
+}
 
+// Region of nodes starting at begin (x, y, z node indices); an empty count reaches to the end of the grid
+void field_region(CustomMagneticField* field, const std::vector<int>& begin, std::vector<int> count, int region[2][3]) {
+    if (begin.size() != 3 || !(count.empty() || count.size() == 3)) {
+        throw std::runtime_error("begin and count need three node indices (x, y, z).");
+    }
+    int shape[3];
+    field->getGridShape(shape);
+    for (int a = 0; a < 3; ++a) {
+        region[0][a] = begin[a];
+        region[1][a] = count.empty() ? shape[a] - begin[a] : count[a];
+    }
+}
 
+// Overwrites field map nodes (tesla) between runs. B holds the nodes of the region in the map's flat order,
+// either as a (count_y, count_x, count_z, 3) array or flat; a flat B without count covers the whole map.
+void update_field_map(py::array B, std::vector<int> begin, std::vector<int> count) {
+    CustomMagneticField* field = custom_field();
+    if (count.empty() && B.ndim() == 4) {
+        count = {static_cast<int>(B.shape(1)), static_cast<int>(B.shape(0)), static_cast<int>(B.shape(2))};
+    }
+    int region[2][3];
+    field_region(field, begin, count, region);
+    FieldMapBuffer values = field_map_from_array(B);
+    py::gil_scoped_release release;
+    field->updateRegion(values, region[0], region[1]);
+}
+
+// For "storage": "external" maps, which read the array given to initialize() directly: call after writing
+// into that array, for the region that changed
+void field_map_modified(std::vector<int> begin, std::vector<int> count) {
+    CustomMagneticField* field = custom_field();
+    int region[2][3];
+    field_region(field, begin, count, region);
+    py::gil_scoped_release release;
+    field->regionModified(region[0], region[1]);
+}
+
+DetectorConstruction* detector_from_specs(const Json::Value& detectorData, const FieldMapBuffer& B_map) {
+    int type = detectorData["type"].asInt();
+    if (type==3) {
+        return new DetectorConstruction(detectorData);
+    }
+    else if (type == 4) {
+        return new ToyDetectorConstruction(detectorData, B_map);
+    } else
+        throw std::runtime_error("Invalid detector type specified.");
+}
+
+// num_threads > 1 runs events on a tasking run manager with that many worker threads, otherwise sequentially
+std::string initialize_with_field(int rseed_0, int rseed_1, int rseed_2, int rseed_3, std::string detector_specs,
+                                  FieldMapBuffer B_map, int num_threads) {
+    if (runManager != nullptr) {
+        throw std::runtime_error("Geant4 is already initialized, use reconfigure(...) to change the detector.");
+    }
+    //#include <chrono>
+    //auto start = std::chrono::high_resolution_clock::now(); 
+    //auto end = std::chrono::high_resolution_clock::now();
+    //std::cout<<"TIME JSON" << std::chrono::duration_cast<std::chrono::seconds>(end - start).count() << std::endl;
+
+    // The whole configuration is read and checked before the run manager exists, which can only be created
+    // once per process: a bad detector JSON must leave initialize() callable again.
     bool applyStepLimiter = false;
     bool storeAll = false;
     bool storePrimary = true;
+    bool storeFloat32 = false;
+    size_t stepReserve = 0;
+    std::vector<double> scoringPlanes;
+    KillRegions killRegions;
+    // Physics tables are cached here between initializations, off unless given
+    const char* physicsCacheEnv = std::getenv("MUON_SLABS_PHYSICS_CACHE");
+    std::string physicsCacheDir = physicsCacheEnv != nullptr ? physicsCacheEnv : "";
+    // "full" is FTFP_BERT, "transport" the TransportPhysicsList
+    std::string physicsMode = "full";
+    bool muonEm = false;
     
     if (detector_specs.empty())
         detector = new DetectorConstruction();
@@ -219,15 +552,7 @@ std::string initialize( int rseed_0,
 
         
 
-        int type = detectorData["type"].asInt();
         applyStepLimiter = (detectorData["limits"]["max_step_length"].asDouble() > 0);
-        if (type==3) {
-            detector = new DetectorConstruction(detectorData);
-        }
-        else if (type == 4)
-            detector = new ToyDetectorConstruction(detectorData, B_map);
-        } else
-            throw std::runtime_error("Invalid detector type specified.");
 
         if (detectorData.isMember("store_all")) {
             storeAll = detectorData["store_all"].asBool();
@@ -235,12 +560,47 @@ std::string initialize( int rseed_0,
         if (detectorData.isMember("store_primary")) {
             storePrimary = detectorData["store_primary"].asBool();
         }
+        storeFloat32 = detectorData.get("store_float32", false).asBool();
+        stepReserve = detectorData.get("step_reserve", 0).asUInt();
+        for (const Json::Value& z : detectorData["scoring_planes"]) {
+            scoringPlanes.push_back(z.asDouble());
+        }
+        killRegions = KillRegions(detectorData["kill_regions"]);
+        physicsCacheDir = detectorData.get("physics_cache_dir", physicsCacheDir).asString();
+        physicsMode = detectorData.get("physics_mode", physicsMode).asString();
+        muonEm = detectorData.get("muon_em", false).asBool();
+        if (physicsMode != "full" && physicsMode != "transport") {
+            throw std::runtime_error("Unknown physics mode: " + physicsMode);
+        }
+        detector = detector_from_specs(detectorData, B_map);
     }
 
+    randomEngine = new CLHEP::MTwistEngine(rseed_0);
+    long seeds[4] = {rseed_0, rseed_1, rseed_2, rseed_3};
+    std::copy(seeds, seeds + 4, baseSeeds);
+
+    CLHEP::HepRandom::setTheSeeds(seeds);
+    G4Random::setTheSeeds(seeds);
+    if (num_threads > 1) {
+        runManager = G4RunManagerFactory::CreateRunManager(G4RunManagerType::Tasking, num_threads);
+    } else {
+        runManager = G4RunManagerFactory::CreateRunManager(G4RunManagerType::Serial);
+    }
+    std::cout<<"Run manager threads: "<<std::max(num_threads, 1)<<std::endl;
+
     std::cout<<"Detector initializing..."<<std::endl;
     runManager->SetUserInitialization(detector);
     std::cout<<"Detector initialized"<<std::endl;
-    auto physicsList = new FTFP_BERT;
+    G4VModularPhysicsList* physicsList = nullptr;
+    std::string physicsConfig;
+    if (physicsMode == "full") {
+        physicsList = new FTFP_BERT;
+        physicsConfig = "FTFP_BERT";
+    } else {
+        physicsList = new TransportPhysicsList(muonEm);
+        physicsConfig = muonEm ? "Transport+MuonEm+SecondaryEm" : "Transport";
+    }
+    std::cout<<"Physics mode: "<<physicsConfig<<std::endl;
 
 //    auto physicsList = new QGSP_BERT_HP_PEN();
 //    auto physicsList = new QGSP_BERT;
@@ -250,23 +610,13 @@ std::string initialize( int rseed_0,
     }
     runManager->SetUserInitialization(physicsList);
     std::cout<<"Physics list initialized"<<std::endl;
-    customEventAction = new CustomEventAction();
-    std::cout<<"Event action initialized"<<std::endl;
-    primariesGenerator = new PrimaryGeneratorAction();
-    std::cout<<"Primary generator initialized"<<std::endl;
-    steppingAction = new CustomSteppingAction();
-    std::cout<<"Stepping action initialized"<<std::endl;
-    primariesGenerator->setSteppingAction(steppingAction);
-    customEventAction->setSteppingAction(steppingAction);
-    steppingAction->setStoreAll(storeAll);
-    steppingAction->setStorePrimary(storePrimary);
-    std::cout<<"Store all: "<<storeAll<<std::endl;
-//    auto actionInitialization = new B4aActionInitialization(detector, eventAction, primariesGenerator);
-//    runManager->SetUserInitialization(actionInitialization);
-
-    runManager->SetUserAction(primariesGenerator);
-    runManager->SetUserAction(steppingAction);
-    runManager->SetUserAction(customEventAction);
+    actionInitialization = new ActionInitialization(storeAll, storePrimary, storeFloat32, stepReserve);
+    std::cout<<"Store all: "<<storeAll<<", float32: "<<storeFloat32<<std::endl;
+    actionInitialization->setScoringPlanes(scoringPlanes);
+    std::cout<<"Scoring planes: "<<scoringPlanes.size()<<std::endl;
+    actionInitialization->setKillRegions(killRegions);
+    std::cout<<"Kill regions: "<<killRegions.size()<<std::endl;
+    runManager->SetUserInitialization(actionInitialization);
     std::cout<<"User actions set"<<std::endl;
 
     // Get the pointer to the User Interface manager
@@ -275,6 +625,19 @@ std::string initialize( int rseed_0,
 
     ui_manager->ApplyCommand(std::string("/run/initialize"));
     std::cout<<"Run initialized"<<std::endl;
+
+    if (!physicsCacheDir.empty()) {
+        PhysicsTableCache cache(physicsCacheDir);
+        std::string key = cache.computeKey(physicsConfig + (applyStepLimiter ? "+G4StepLimiterPhysics" : ""), physicsList);
+        if (cache.retrieve(key, physicsList)) {
+            std::cout<<"Physics tables retrieved from cache "<<key<<std::endl;
+        } else {
+            // An empty run builds the tables now so they can be stored
+            runManager->BeamOn(0);
+            if (cache.store(key, physicsList))
+                std::cout<<"Physics tables stored in cache "<<key<<std::endl;
+        }
+    }
     ui_manager->ApplyCommand(std::string("/run/printProgress 100"));
 
     std::cout<<"Initialized"<<std::endl;
@@ -290,8 +653,96 @@ std::string initialize( int rseed_0,
     return output;
 }
 
+void set_scoring_planes(std::vector<double> z_planes) {
+    check_initialized();
+    actionInitialization->setScoringPlanes(z_planes);
+}
+
+// Swaps the geometry and field for a new detector of the same session. The run manager, physics list and its
+// tables, user actions and random engine are kept; the geometry is rebuilt from detector_specs and B. Needs a
+// sequential run manager (initialize with num_threads = 1): tasking workers keep the detector they started
+// with and would rebuild the deleted one. The new detector must not bring materials the physics tables lack a cut couple for, otherwise
+// the tables for those are built at the next run. Step limits follow the new "limits" only if the step
+// limiter was registered at initialize(). Sensitive film hits not yet collected are kept and returned by the
+// next collect_from_sensitive().
+std::string reconfigure(std::string detector_specs, py::array B) {
+    check_initialized();
+    if (runManager->GetRunManagerType() != G4RunManager::sequentialRM) {
+        throw std::runtime_error("reconfigure needs a sequential run manager, initialize with num_threads = 1.");
+    }
+    if (outputWriter) {
+        throw std::runtime_error("Close the output file before reconfiguring.");
+    }
+    Json::Value detectorData;
+    Json::CharReaderBuilder readerBuilder;
+    std::string errs;
+    std::istringstream iss(detector_specs);
+    if (!Json::parseFromStream(readerBuilder, iss, &detectorData, &errs)) {
+        throw std::runtime_error("Failed to parse JSON: " + errs);
+    }
+
+    // Everything that can reject the specs comes before the swap, a bad one leaves the session as it was
+    std::vector<double> scoringPlanes;
+    for (const Json::Value& z : detectorData["scoring_planes"]) {
+        scoringPlanes.push_back(z.asDouble());
+    }
+    KillRegions killRegions(detectorData["kill_regions"]);
+    DetectorConstruction* next = detector_from_specs(detectorData, field_map_from_array(B));
+
+    DetectorConstruction* previous = detector;
+    detector = next;
+    runManager->SetUserInitialization(detector);
+    // Drops the old volumes and solids, the geometry (and with it the field) is built again by /run/initialize
+    runManager->ReinitializeGeometry(true);
+    {
+        py::gil_scoped_release release;
+        ui_manager->ApplyCommand(std::string("/run/initialize"));
+    }
+    delete previous;
+
+    actionInitialization->setScoringPlanes(scoringPlanes);
+    actionInitialization->setKillRegions(killRegions);
+    std::cout<<"Reconfigured"<<std::endl;
+
+    Json::Value returnData;
+    returnData["weight_total"] = detector->getDetectorWeight();
+    Json::StreamWriterBuilder writer;
+    writer["indentation"] = "";
+    return Json::writeString(writer, returnData);
+}
+
+std::string initialize( int rseed_0,
+                 int rseed_1, int rseed_2, int rseed_3, std::string detector_specs, py::array B, int num_threads) {
+    return initialize_with_field(rseed_0, rseed_1, rseed_2, rseed_3, detector_specs, field_map_from_array(B), num_threads);
+}
+
+// Like initialize, with the detector JSON and the field map of a bundle written by write_detector_bundle. The
+// field is memory-mapped, not read.
+std::string initialize_from_bundle(int rseed_0, int rseed_1, int rseed_2, int rseed_3, std::string path, int num_threads) {
+    Json::Value detectorData;
+    FieldMapBuffer B_map;
+    DetectorBundle::load(path, detectorData, B_map);
+    Json::StreamWriterBuilder writer;
+    writer["indentation"] = "";
+    return initialize_with_field(rseed_0, rseed_1, rseed_2, rseed_3, Json::writeString(writer, detectorData), B_map,
+                                 num_threads);
+}
+
+void write_detector_bundle(std::string path, std::string detector_specs, py::array B) {
+    Json::Value detectorData;
+    Json::CharReaderBuilder readerBuilder;
+    std::string errs;
+    std::istringstream iss(detector_specs);
+    if (!Json::parseFromStream(readerBuilder, iss, &detectorData, &errs)) {
+        throw std::runtime_error("Failed to parse JSON: " + errs);
+    }
+    FieldMapBuffer field = field_map_from_array(B);
+    py::gil_scoped_release release;
+    DetectorBundle::write(path, detectorData, field);
+}
+
 void kill_secondary_tracks(bool do_kill) {
-    steppingAction->setKillSecondary(do_kill);
+    actionInitialization->setKillSecondary(do_kill);
 }
 
 void visualize() {
@@ -319,12 +770,52 @@ void visualize() {
 PYBIND11_MODULE(muon_slabs, m) {
     m.def("add", &add, "A function which adds two numbers");
     m.def("simulate_muon", &simulate_muon, "A function which simulates a muon through geant4 and returns the steps");
-    m.def("initialize", &initialize, "Initialize geant4 stuff");
+    m.def("simulate_muons", &simulate_muons, "Simulate an (N, 7) array of muons in a single run, steps returned as flat columns with offsets",
+          py::arg("muons"), py::arg("collect") = true);
+    m.def("simulate_muons_forked", &simulate_muons_forked,
+          "simulate_muons split over forked worker processes that share the initialized state copy-on-write",
+          py::arg("muons"), py::arg("num_workers"));
+    m.def("initialize", &initialize, "Initialize geant4 stuff",
+          py::arg("rseed_0"), py::arg("rseed_1"), py::arg("rseed_2"), py::arg("rseed_3"), py::arg("detector_specs"),
+          py::arg("B"), py::arg("num_threads") = 1);
+    m.def("initialize_from_bundle", &initialize_from_bundle, "Initialize geant4 from a detector bundle",
+          py::arg("rseed_0"), py::arg("rseed_1"), py::arg("rseed_2"), py::arg("rseed_3"), py::arg("path"),
+          py::arg("num_threads") = 1);
+    m.def("write_detector_bundle", &write_detector_bundle,
+          "Write the detector JSON and its field map (tesla, 3 values per node) into one bundle file",
+          py::arg("path"), py::arg("detector_specs"), py::arg("B"));
+    m.def("reconfigure", &reconfigure, "Replace the detector geometry and field, keeping physics and user actions",
+          py::arg("detector_specs"), py::arg("B"));
     m.def("collect", &collect, "Collect back the data");
+    m.def("open_output", &open_output, "Append the steps of all following events to a chunked, compressed step file",
+          py::arg("path"), py::arg("chunk_steps") = 1 << 20, py::arg("compression_level") = 1, py::arg("float32") = false);
+    m.def("close_output", &close_output, "Finish the step file, returns the number of events and bytes written");
+    m.def("read_output", &read_output, "Read events [begin, end) of a step file",
+          py::arg("path"), py::arg("begin") = 0, py::arg("end") = -1);
     m.def("collect_from_sensitive", &collect_from_sensitive, "Collect back the data from the sensitive film placed");
     m.def("set_field_value", &set_field_value, "Set the magnetic field value");
     m.def("set_kill_momenta", &set_kill_momenta, "Set the kill momenta");
+    m.def("set_scoring_planes", &set_scoring_planes,
+          "Record only the crossings of the given z planes (m) instead of every step; an empty list records steps again",
+          py::arg("z_planes"));
     m.def("kill_secondary_tracks", &kill_secondary_tracks, "Kill all tracks from resulting cascade");
+    m.def("evaluate_field", &evaluate_field, "Evaluate the magnetic field (tesla) at an (N, 3) array of points (m)",
+          py::arg("points"), py::arg("num_threads") = 0);
+    m.def("track_in_field", &track_in_field,
+          "RK4 tracking of an (N, 7) array of x, y, z [m], px, py, pz [GeV], charge through the magnetic field only",
+          py::arg("particles"), py::arg("step_length") = 0.05, py::arg("max_steps") = 8000, py::arg("adaptive") = false,
+          py::arg("tolerance") = 1e-5, py::arg("max_step_length") = 1.0,
+          py::arg("z_stop") = std::numeric_limits<double>::infinity(), py::arg("store_trajectories") = false,
+          py::arg("num_threads") = 0);
+    m.def("ingest_field_map", &ingest_field_map,
+          "Field map dict (B, ranges, symmetry) from unordered (N, 3) points (m) and B (tesla)",
+          py::arg("points"), py::arg("B"), py::arg("symmetry") = "auto", py::arg("tolerance") = 1e-3,
+          py::arg("num_threads") = 0);
+    m.def("update_field_map", &update_field_map, "Overwrite field map nodes (tesla) in place between runs",
+          py::arg("B"), py::arg("begin") = std::vector<int>{0, 0, 0}, py::arg("count") = std::vector<int>());
+    m.def("field_map_modified", &field_map_modified, "Refresh an external field map after writing into its array",
+          py::arg("begin") = std::vector<int>{0, 0, 0}, py::arg("count") = std::vector<int>());
+    m.def("field_cache_stats", &field_cache_stats, "Hit/miss counts of the field lookup cache", py::arg("reset") = false);
     m.def("visualize", &visualize, "Visualize");
 }
 
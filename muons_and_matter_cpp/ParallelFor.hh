@@ -0,0 +1,36 @@
+#ifndef PARALLELFOR_HH
+#define PARALLELFOR_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Splits [0, n) into contiguous chunks and runs body(begin, end) for each on its own thread.
+// numThreads <= 0 uses all hardware threads. The calling thread takes the first chunk.
+template <class Body>
+void parallelFor(size_t n, int numThreads, Body body) {
+    if (numThreads <= 0) {
+        numThreads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    size_t nChunks = std::min(static_cast<size_t>(numThreads), n);
+    if (nChunks <= 1) {
+        if (n > 0)
+            body(size_t(0), n);
+        return;
+    }
+
+    size_t chunk = (n + nChunks - 1) / nChunks;
+    std::vector<std::thread> workers;
+    workers.reserve(nChunks - 1);
+    for (size_t begin = chunk; begin < n; begin += chunk) {
+        size_t end = std::min(begin + chunk, n);
+        workers.emplace_back([&body, begin, end]() { body(begin, end); });
+    }
+    body(size_t(0), std::min(chunk, n));
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+#endif
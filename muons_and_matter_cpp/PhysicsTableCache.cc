@@ -0,0 +1,74 @@
+#include "PhysicsTableCache.hh"
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include "G4VUserPhysicsList.hh"
+#include "G4Material.hh"
+#include "G4Element.hh"
+#include "G4Version.hh"
+
+namespace {
+    uint64_t fnv1a(const std::string& text) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (unsigned char c : text) {
+            hash ^= c;
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+}
+
+PhysicsTableCache::PhysicsTableCache(const std::string& rootDirectory) : fRoot(rootDirectory) {
+}
+
+std::string PhysicsTableCache::directory(const std::string& key) const {
+    return (std::filesystem::path(fRoot) / key).string();
+}
+
+std::string PhysicsTableCache::computeKey(const std::string& physicsConfig, G4VUserPhysicsList* physicsList) const {
+    std::ostringstream description;
+    description.precision(17);
+    description << physicsConfig << ';' << G4VERSION_NUMBER << ';' << physicsList->GetDefaultCutValue() << ';';
+    for (const G4Material* material : *G4Material::GetMaterialTable()) {
+        description << material->GetName() << ',' << material->GetDensity() << ',' << material->GetState() << ','
+                    << material->GetTemperature() << ',' << material->GetPressure();
+        const G4double* fractions = material->GetFractionVector();
+        for (size_t idx = 0; idx < material->GetNumberOfElements(); ++idx) {
+            description << ',' << material->GetElement(idx)->GetName() << ':' << fractions[idx];
+        }
+        description << ';';
+    }
+
+    std::ostringstream key;
+    key << std::hex << fnv1a(description.str());
+    return key.str();
+}
+
+bool PhysicsTableCache::retrieve(const std::string& key, G4VUserPhysicsList* physicsList) const {
+    std::error_code error;
+    if (!std::filesystem::is_directory(directory(key), error)) {
+        return false;
+    }
+    physicsList->SetPhysicsTableRetrieved(directory(key));
+    return true;
+}
+
+bool PhysicsTableCache::store(const std::string& key, G4VUserPhysicsList* physicsList) const {
+    std::error_code error;
+    std::string target = directory(key);
+    std::string staging = target + ".tmp" + std::to_string(getpid());
+    std::filesystem::create_directories(staging, error);
+    bool stored = !error && physicsList->StorePhysicsTable(staging);
+    if (stored) {
+        std::filesystem::rename(staging, target, error);
+        // Another job may have put the same tables in place first, theirs are as good as ours
+        stored = !error || std::filesystem::is_directory(target);
+    }
+    std::filesystem::remove_all(staging, error);
+    if (!stored) {
+        std::cerr << "Could not store physics tables in " << target << std::endl;
+    }
+    return stored;
+}
@@ -0,0 +1,30 @@
+#ifndef PHYSICSTABLECACHE_HH
+#define PHYSICSTABLECACHE_HH
+
+#include <string>
+
+class G4VUserPhysicsList;
+
+// Directory of physics tables stored with Geant4's store/retrieve mechanism, one subdirectory per key. The key
+// hashes the physics configuration, the Geant4 version, the default production cut and every material, so
+// tables are only reused for the setup they were built for. Stores go to a temporary directory renamed into
+// place, so concurrent jobs building the same key never see a partial one.
+class PhysicsTableCache {
+public:
+    explicit PhysicsTableCache(const std::string& rootDirectory);
+
+    // physicsConfig names the physics list and everything registered on top of it. Call after the geometry
+    // is constructed, the material table is part of the key.
+    std::string computeKey(const std::string& physicsConfig, G4VUserPhysicsList* physicsList) const;
+    // Points the physics list at the tables stored under key, if there are any. Call before the first run.
+    bool retrieve(const std::string& key, G4VUserPhysicsList* physicsList) const;
+    // Stores the tables built by the last run under key; returns false (and keeps going) if that fails
+    bool store(const std::string& key, G4VUserPhysicsList* physicsList) const;
+
+private:
+    std::string fRoot;
+
+    std::string directory(const std::string& key) const;
+};
+
+#endif
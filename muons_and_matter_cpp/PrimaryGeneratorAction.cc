@@ -6,7 +6,7 @@
 #include <iostream>
 
 PrimaryGeneratorAction::PrimaryGeneratorAction()
-: G4VUserPrimaryGeneratorAction()
+: G4VUserPrimaryGeneratorAction(), fParticleGun(nullptr), primaryQueue(nullptr), m_steppingAction(nullptr)
 {
 
 //    G4int n_particle = 1;
@@ -41,14 +41,24 @@ void PrimaryGeneratorAction::GeneratePrimaries(G4Event* anEvent)
 //    fParticleGun->GeneratePrimaryVertex(anEvent);
 //    std::cout<<"Hello from the PrimaryGeneratorAction::GeneratePrimaries!\n";
 
+    Primary primary = {next_x, next_y, next_z, next_px, next_py, next_pz, next_charge};
+    if (primaryQueue != nullptr && !primaryQueue->empty()) {
+        G4int eventID = anEvent->GetEventID();
+        if (eventID < 0 || static_cast<size_t>(eventID) >= primaryQueue->size()) {
+            G4cerr << "Error: event " << eventID << " has no queued primary" << G4endl;
+            exit(1);
+        }
+        primary = (*primaryQueue)[eventID];
+    }
+
     // Define particle properties
     G4String particleName = "mu-";
 
-    if(next_charge == 1)
+    if(primary.charge == 1)
         particleName = "mu+";
 
-    G4ThreeVector position(next_x*m, next_y*m, next_z*m);
-    G4ThreeVector momentum(next_px*GeV, next_py*GeV, next_pz*GeV);
+    G4ThreeVector position(primary.x*m, primary.y*m, primary.z*m);
+    G4ThreeVector momentum(primary.px*GeV, primary.py*GeV, primary.pz*GeV);
     G4double time = 0;
     // Get particle definition from G4ParticleTable
     G4ParticleTable* particleTable = G4ParticleTable::GetParticleTable();
@@ -95,3 +105,7 @@ void PrimaryGeneratorAction::setNextPosition(double nextX, double nextY, double
 void PrimaryGeneratorAction::setNextCharge(int charge) {
     PrimaryGeneratorAction::next_charge = charge;
 }
+
+void PrimaryGeneratorAction::setPrimaryQueue(const std::vector<Primary>* queue) {
+    primaryQueue = queue;
+}
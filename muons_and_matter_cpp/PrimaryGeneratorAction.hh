@@ -5,10 +5,18 @@
 #include "G4ParticleGun.hh"
 #include "G4Event.hh"
 #include "CustomSteppingAction.hh"
+#include <vector>
 
 class PrimaryGeneratorAction : public G4VUserPrimaryGeneratorAction
 {
 public:
+    // One queued muon: position in m, momentum in GeV, charge +1 or -1
+    struct Primary {
+        double x, y, z;
+        double px, py, pz;
+        int charge;
+    };
+
     PrimaryGeneratorAction();
     virtual ~PrimaryGeneratorAction();
 
@@ -24,6 +32,7 @@ private:
     double next_y;
     double next_z;
     int next_charge;
+    const std::vector<Primary>* primaryQueue;
 public:
     void setNextMomenta(double nextPx, double nextPy, double nextPz);
     void setNextPosition(double nextX, double nextY, double nextZ);
@@ -32,6 +41,9 @@ protected:
 public:
     void setNextCharge(int charge);
 
+    // While the (shared, possibly empty) queue has entries, event n of the run fires queue[n] instead of the next_* muon
+    void setPrimaryQueue(const std::vector<Primary>* queue);
+
 protected:
     CustomSteppingAction * m_steppingAction;
 };
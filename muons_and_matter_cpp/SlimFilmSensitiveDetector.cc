@@ -0,0 +1,37 @@
+#include "SlimFilmSensitiveDetector.hh"
+#include "G4Step.hh"
+#include "G4Track.hh"
+#include "G4Event.hh"
+#include "G4EventManager.hh"
+#include "G4SystemOfUnits.hh"
+
+SlimFilmSensitiveDetector::SlimFilmSensitiveDetector(const G4String& name) : G4VSensitiveDetector(name) {
+}
+
+SlimFilmSensitiveDetector::~SlimFilmSensitiveDetector() {
+}
+
+G4bool SlimFilmSensitiveDetector::ProcessHits(G4Step* step, G4TouchableHistory*) {
+    G4StepPoint* preStepPoint = step->GetPreStepPoint();
+    if (preStepPoint->GetStepStatus() != fGeomBoundary) {
+        return false;
+    }
+
+    G4Track* track = step->GetTrack();
+    const G4ThreeVector& position = preStepPoint->GetPosition();
+    const G4ThreeVector& momentum = preStepPoint->GetMomentum();
+    const double values[StepArena::kNumColumns] = {
+            momentum.x() / GeV, momentum.y() / GeV, momentum.z() / GeV,
+            position.x() / m, position.y() / m, position.z() / m,
+            step->GetStepLength() / m, step->GetTotalEnergyDeposit()};
+    hits.push(values, track->GetTrackID());
+    pdgIds.push_back(track->GetDefinition()->GetPDGEncoding());
+    eventIds.push_back(G4EventManager::GetEventManager()->GetConstCurrentEvent()->GetEventID());
+    return true;
+}
+
+void SlimFilmSensitiveDetector::clear() {
+    hits.reset();
+    pdgIds.clear();
+    eventIds.clear();
+}
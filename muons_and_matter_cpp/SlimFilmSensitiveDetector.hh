@@ -0,0 +1,30 @@
+#ifndef SLIMFILMSENSITIVEDETECTOR_HH
+#define SLIMFILMSENSITIVEDETECTOR_HH
+
+#include <vector>
+#include "G4VSensitiveDetector.hh"
+#include "StepArena.hh"
+
+class G4Step;
+class G4TouchableHistory;
+
+// Thin film recording every track that enters it: momentum and position where the track crosses into the
+// film, in the step columns (GeV, m), plus the PDG code and event id of every hit. Only steps starting on
+// the film's boundary count, so a track crossing the film is recorded once however many steps it takes
+// inside. Hits accumulate over events until collected; clear() keeps the buffers' capacity for the next run.
+// One film exists per thread.
+class SlimFilmSensitiveDetector : public G4VSensitiveDetector {
+public:
+    explicit SlimFilmSensitiveDetector(const G4String& name);
+    ~SlimFilmSensitiveDetector() override;
+
+    G4bool ProcessHits(G4Step* step, G4TouchableHistory* history) override;
+
+    void clear();
+
+    StepArena hits;
+    std::vector<int> pdgIds;
+    std::vector<int> eventIds;
+};
+
+#endif
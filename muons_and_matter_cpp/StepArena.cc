@@ -0,0 +1,78 @@
+#include "StepArena.hh"
+#include <algorithm>
+
+const char* StepArena::columnName(int column) {
+    static const char* names[kNumColumns] = {"px", "py", "pz", "x", "y", "z", "step_length", "charge_deposit"};
+    return names[column];
+}
+
+StepArena::StepArena(bool float32) : fFloat32(float32), fReserveHint(0) {
+}
+
+void StepArena::setFloat32(bool float32) {
+    if (float32 != fFloat32) {
+        clear();
+        fFloat32 = float32;
+    }
+}
+
+void StepArena::setReserveHint(size_t numSteps) {
+    fReserveHint = numSteps;
+}
+
+void StepArena::reset() {
+    fReserveHint = std::max(fReserveHint, size());
+    for (int c = 0; c < kNumColumns; ++c) {
+        fDouble[c].clear();
+        fFloat[c].clear();
+    }
+    fTrackId.clear();
+    fTrackStarts.clear();
+    reserve(fReserveHint);
+}
+
+void StepArena::clear() {
+    for (int c = 0; c < kNumColumns; ++c) {
+        std::vector<double>().swap(fDouble[c]);
+        std::vector<float>().swap(fFloat[c]);
+    }
+    std::vector<int>().swap(fTrackId);
+    std::vector<long>().swap(fTrackStarts);
+}
+
+void StepArena::reserve(size_t numSteps) {
+    for (int c = 0; c < kNumColumns; ++c) {
+        if (fFloat32)
+            fFloat[c].reserve(numSteps);
+        else
+            fDouble[c].reserve(numSteps);
+    }
+    fTrackId.reserve(numSteps);
+}
+
+void StepArena::append(const StepArena& other) {
+    long shift = static_cast<long>(size());
+    for (long start : other.fTrackStarts) {
+        fTrackStarts.push_back(start + shift);
+    }
+    for (int c = 0; c < kNumColumns; ++c) {
+        if (fFloat32)
+            fFloat[c].insert(fFloat[c].end(), other.fFloat[c].begin(), other.fFloat[c].end());
+        else
+            fDouble[c].insert(fDouble[c].end(), other.fDouble[c].begin(), other.fDouble[c].end());
+    }
+    fTrackId.insert(fTrackId.end(), other.fTrackId.begin(), other.fTrackId.end());
+}
+
+void StepArena::assign(const StepArena& other) {
+    clear();
+    fFloat32 = other.fFloat32;
+    for (int c = 0; c < kNumColumns; ++c) {
+        if (fFloat32)
+            fFloat[c] = other.fFloat[c];
+        else
+            fDouble[c] = other.fDouble[c];
+    }
+    fTrackId = other.fTrackId;
+    fTrackStarts = other.fTrackStarts;
+}
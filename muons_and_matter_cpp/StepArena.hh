@@ -0,0 +1,72 @@
+#ifndef STEPARENA_HH
+#define STEPARENA_HH
+
+#include <cstddef>
+#include <vector>
+
+// Columnar storage for step records. Every value column is one contiguous vector, in double or, in float32
+// mode, in float. reset() empties the arena but keeps the capacity, so after the first few events recording a
+// step never reallocates; the reserve hint covers the first event and grows with the largest event seen.
+// Geant4 finishes one track before starting the next, so the steps of a track are contiguous and
+// trackStarts() indexes where each track's steps begin.
+class StepArena {
+public:
+    enum Column { PX, PY, PZ, X, Y, Z, STEP_LENGTH, CHARGE_DEPOSIT, kNumColumns };
+    static const char* columnName(int column);
+
+    explicit StepArena(bool float32 = false);
+
+    // Changing the precision drops the stored steps
+    void setFloat32(bool float32);
+    bool isFloat32() const { return fFloat32; }
+    void setReserveHint(size_t numSteps);
+    size_t getReserveHint() const { return fReserveHint; }
+
+    size_t size() const { return fTrackId.size(); }
+    bool empty() const { return fTrackId.empty(); }
+
+    // values in the order of Column
+    inline void push(const double values[kNumColumns], int trackId) {
+        if (fTrackId.empty() || fTrackId.back() != trackId) {
+            fTrackStarts.push_back(static_cast<long>(fTrackId.size()));
+        }
+        if (fFloat32) {
+            for (int c = 0; c < kNumColumns; ++c)
+                fFloat[c].push_back(static_cast<float>(values[c]));
+        } else {
+            for (int c = 0; c < kNumColumns; ++c)
+                fDouble[c].push_back(values[c]);
+        }
+        fTrackId.push_back(trackId);
+    }
+
+    // Empties the arena, keeps the capacity and makes sure it covers the reserve hint
+    void reset();
+    // Drops the stored steps and releases the capacity
+    void clear();
+    void reserve(size_t numSteps);
+    // Appends the steps of another arena of the same precision
+    void append(const StepArena& other);
+    // Replaces the contents with an exactly sized copy of other (precision included)
+    void assign(const StepArena& other);
+
+    std::vector<double>& doubleColumn(int column) { return fDouble[column]; }
+    std::vector<float>& floatColumn(int column) { return fFloat[column]; }
+    const std::vector<double>& doubleColumn(int column) const { return fDouble[column]; }
+    const std::vector<float>& floatColumn(int column) const { return fFloat[column]; }
+    double value(int column, size_t step) const { return fFloat32 ? fFloat[column][step] : fDouble[column][step]; }
+    std::vector<int>& trackIds() { return fTrackId; }
+    const std::vector<int>& trackIds() const { return fTrackId; }
+    std::vector<long>& trackStarts() { return fTrackStarts; }
+    const std::vector<long>& trackStarts() const { return fTrackStarts; }
+
+private:
+    bool fFloat32;
+    size_t fReserveHint;
+    std::vector<double> fDouble[kNumColumns];
+    std::vector<float> fFloat[kNumColumns];
+    std::vector<int> fTrackId;
+    std::vector<long> fTrackStarts;
+};
+
+#endif
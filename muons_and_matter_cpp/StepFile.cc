@@ -0,0 +1,334 @@
+#include "StepFile.hh"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace {
+    const char kFileMagic[8] = {'M', 'U', 'S', 'T', 'E', 'P', 'S', '1'};
+    const char kChunkMagic[4] = {'C', 'H', 'N', 'K'};
+    const char kTrailerMagic[8] = {'M', 'U', 'S', 'T', 'E', 'N', 'D', '1'};
+    const uint32_t kVersion = 1;
+
+    struct SectionView {
+        const void* data;
+        size_t size;
+    };
+
+    template <class T>
+    SectionView view(const std::vector<T>& values) {
+        return {values.data(), values.size() * sizeof(T)};
+    }
+
+    template <class T>
+    void decodeSection(const std::vector<unsigned char>& blob, uint64_t rawSize, std::vector<T>& out) {
+        out.resize(rawSize / sizeof(T));
+        if (rawSize == 0)
+            return;
+        if (blob.size() == rawSize) {
+            std::memcpy(out.data(), blob.data(), rawSize);
+            return;
+        }
+        uLongf destLength = static_cast<uLongf>(rawSize);
+        if (uncompress(reinterpret_cast<Bytef*>(out.data()), &destLength, blob.data(), static_cast<uLong>(blob.size())) != Z_OK ||
+            destLength != rawSize)
+            throw std::runtime_error("Step file: corrupt chunk section.");
+    }
+}
+
+StepFileWriter::StepFileWriter(const std::string& path, bool float32, size_t chunkSteps, int compressionLevel,
+                               size_t maxPendingChunks)
+    : fPath(path), fFloat32(float32), fChunkSteps(std::max<size_t>(chunkSteps, 1)), fCompressionLevel(compressionLevel),
+      fMaxPendingChunks(std::max<size_t>(maxPendingChunks, 1)), fFile(nullptr), fHeldChunks(0), fClosing(false), fClosed(false),
+      fEventsWritten(0), fBytesWritten(0) {
+    fFile = std::fopen(path.c_str(), "wb");
+    if (fFile == nullptr)
+        throw std::runtime_error("Cannot open step file " + path + " for writing.");
+
+    StepFile::FileHeader header;
+    std::memcpy(header.magic, kFileMagic, sizeof(kFileMagic));
+    header.version = kVersion;
+    header.float32 = float32 ? 1 : 0;
+    header.numValueColumns = StepArena::kNumColumns;
+    header.reserved = 0;
+    writeBytes(&header, sizeof(header));
+
+    fThread = std::thread(&StepFileWriter::run, this);
+}
+
+StepFileWriter::~StepFileWriter() {
+    try {
+        close();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+void StepFileWriter::appendEvent(long eventID, const StepArena& steps) {
+    std::unique_lock<std::mutex> lock(fMutex);
+    if (fClosing)
+        throw std::runtime_error("Step file " + fPath + " is already closed.");
+    if (!fOpenChunk) {
+        fOpenChunk.reset(new Chunk());
+        fOpenChunk->steps.setFloat32(fFloat32);
+        fOpenChunk->steps.reserve(fChunkSteps);
+        fOpenChunk->offsets.push_back(0);
+    }
+
+    Chunk& chunk = *fOpenChunk;
+    if (steps.isFloat32() == fFloat32) {
+        chunk.steps.append(steps);
+    } else {
+        // Precision differs from the file's, convert into a scratch arena first so the event keeps its own
+        // track starts
+        fConverted.setFloat32(fFloat32);
+        fConverted.reset();
+        for (size_t idx = 0; idx < steps.size(); ++idx) {
+            double values[StepArena::kNumColumns];
+            for (int c = 0; c < StepArena::kNumColumns; ++c)
+                values[c] = steps.value(c, idx);
+            fConverted.push(values, steps.trackIds()[idx]);
+        }
+        chunk.steps.append(fConverted);
+    }
+    chunk.eventIds.push_back(eventID);
+    chunk.offsets.push_back(static_cast<long>(chunk.steps.size()));
+
+    if (chunk.steps.size() >= fChunkSteps) {
+        // The full chunk leaves fOpenChunk before waiting, so other threads fill a new one meanwhile instead
+        // of queueing this one a second time
+        std::unique_ptr<Chunk> full = std::move(fOpenChunk);
+        fHeldChunks += 1;
+        // Back pressure only when the background thread is this many chunks behind
+        fQueueChanged.wait(lock, [this]() { return fPending.size() < fMaxPendingChunks; });
+        fPending.push_back(std::move(full));
+        fHeldChunks -= 1;
+        fQueueChanged.notify_all();
+    }
+}
+
+void StepFileWriter::close() {
+    {
+        std::unique_lock<std::mutex> lock(fMutex);
+        if (fClosed)
+            return;
+        fClosed = true;
+        // Chunks still waiting for a place in the queue are written before the file ends
+        fQueueChanged.wait(lock, [this]() { return fHeldChunks == 0; });
+        if (fOpenChunk && !fOpenChunk->eventIds.empty())
+            fPending.push_back(std::move(fOpenChunk));
+        fClosing = true;
+        fQueueChanged.notify_all();
+    }
+    fThread.join();
+
+    if (fError.empty()) {
+        StepFile::Trailer trailer;
+        trailer.indexOffset = fBytesWritten;
+        trailer.numChunks = fIndex.size();
+        trailer.numEvents = fEventsWritten;
+        std::memcpy(trailer.magic, kTrailerMagic, sizeof(kTrailerMagic));
+        if (!fIndex.empty())
+            writeBytes(fIndex.data(), fIndex.size() * sizeof(StepFile::IndexEntry));
+        writeBytes(&trailer, sizeof(trailer));
+    }
+    if (std::fclose(fFile) != 0 && fError.empty())
+        fError = "Cannot finish writing step file " + fPath + ".";
+    fFile = nullptr;
+    if (!fError.empty())
+        throw std::runtime_error(fError);
+    std::cout << "Step file " << fPath << ": " << fEventsWritten << " events, " << fBytesWritten << " bytes\n";
+}
+
+unsigned long long StepFileWriter::getEventsWritten() const {
+    return fEventsWritten;
+}
+
+unsigned long long StepFileWriter::getBytesWritten() const {
+    return fBytesWritten;
+}
+
+void StepFileWriter::run() {
+    while (true) {
+        std::unique_ptr<Chunk> chunk;
+        {
+            std::unique_lock<std::mutex> lock(fMutex);
+            fQueueChanged.wait(lock, [this]() { return !fPending.empty() || fClosing; });
+            if (fPending.empty())
+                return;
+            chunk = std::move(fPending.front());
+            fPending.pop_front();
+            fQueueChanged.notify_all();
+        }
+        if (fError.empty()) {
+            try {
+                writeChunk(*chunk);
+            } catch (const std::exception& e) {
+                fError = e.what();
+            }
+        }
+    }
+}
+
+void StepFileWriter::writeChunk(const Chunk& chunk) {
+    const RunRecords& steps = chunk.steps;
+    SectionView sections[StepFile::kNumSections];
+    sections[StepFile::EVENT_IDS] = view(chunk.eventIds);
+    sections[StepFile::EVENT_OFFSETS] = view(chunk.offsets);
+    for (int c = 0; c < StepArena::kNumColumns; ++c) {
+        sections[StepFile::VALUES_BEGIN + c] = fFloat32 ? view(steps.floatColumn(c)) : view(steps.doubleColumn(c));
+    }
+    sections[StepFile::TRACK_IDS] = view(steps.trackIds());
+    sections[StepFile::TRACK_STARTS] = view(steps.trackStarts());
+
+    StepFile::ChunkHeader header;
+    std::memcpy(header.magic, kChunkMagic, sizeof(kChunkMagic));
+    header.numEvents = static_cast<uint32_t>(chunk.eventIds.size());
+    header.numSteps = steps.size();
+    header.numTrackStarts = steps.trackStarts().size();
+
+    std::vector<unsigned char> blobs[StepFile::kNumSections];
+    for (int s = 0; s < StepFile::kNumSections; ++s) {
+        header.rawSize[s] = sections[s].size;
+        header.compressedSize[s] = sections[s].size;
+        if (fCompressionLevel > 0 && sections[s].size > 0) {
+            uLongf length = compressBound(static_cast<uLong>(sections[s].size));
+            blobs[s].resize(length);
+            int status = compress2(blobs[s].data(), &length, static_cast<const Bytef*>(sections[s].data),
+                                   static_cast<uLong>(sections[s].size), fCompressionLevel);
+            // Incompressible sections are stored raw
+            if (status == Z_OK && length < sections[s].size) {
+                blobs[s].resize(length);
+                header.compressedSize[s] = length;
+            } else {
+                blobs[s].clear();
+            }
+        }
+    }
+
+    StepFile::IndexEntry entry;
+    entry.fileOffset = fBytesWritten;
+    entry.firstEvent = fEventsWritten;
+    entry.numEvents = header.numEvents;
+    writeBytes(&header, sizeof(header));
+    for (int s = 0; s < StepFile::kNumSections; ++s) {
+        if (header.compressedSize[s] == header.rawSize[s])
+            writeBytes(sections[s].data, sections[s].size);
+        else
+            writeBytes(blobs[s].data(), blobs[s].size());
+    }
+    fIndex.push_back(entry);
+    fEventsWritten += header.numEvents;
+}
+
+void StepFileWriter::writeBytes(const void* data, size_t size) {
+    if (size > 0 && std::fwrite(data, 1, size, fFile) != size)
+        throw std::runtime_error("Cannot write to step file " + fPath + ".");
+    fBytesWritten += size;
+}
+
+StepFileReader::StepFileReader(const std::string& path) : fFile(nullptr), fNumEvents(0), fCachedChunk(-1) {
+    fFile = std::fopen(path.c_str(), "rb");
+    if (fFile == nullptr)
+        throw std::runtime_error("Cannot open step file " + path + ".");
+
+    StepFile::Trailer trailer;
+    bool valid = std::fread(&fHeader, sizeof(fHeader), 1, fFile) == 1 &&
+                 std::memcmp(fHeader.magic, kFileMagic, sizeof(kFileMagic)) == 0 &&
+                 fHeader.numValueColumns == StepArena::kNumColumns &&
+                 std::fseek(fFile, -static_cast<long>(sizeof(trailer)), SEEK_END) == 0 &&
+                 std::fread(&trailer, sizeof(trailer), 1, fFile) == 1 &&
+                 std::memcmp(trailer.magic, kTrailerMagic, sizeof(kTrailerMagic)) == 0;
+    if (valid) {
+        fIndex.resize(trailer.numChunks);
+        valid = std::fseek(fFile, static_cast<long>(trailer.indexOffset), SEEK_SET) == 0 &&
+                (fIndex.empty() || std::fread(fIndex.data(), sizeof(StepFile::IndexEntry), fIndex.size(), fFile) == fIndex.size());
+    }
+    if (!valid) {
+        std::fclose(fFile);
+        throw std::runtime_error("Not a complete step file: " + path);
+    }
+    fNumEvents = trailer.numEvents;
+}
+
+StepFileReader::~StepFileReader() {
+    if (fFile != nullptr)
+        std::fclose(fFile);
+}
+
+void StepFileReader::loadChunk(size_t chunk) {
+    if (fCachedChunk == static_cast<long>(chunk))
+        return;
+    fCachedChunk = -1;
+
+    StepFile::ChunkHeader header;
+    if (std::fseek(fFile, static_cast<long>(fIndex[chunk].fileOffset), SEEK_SET) != 0 ||
+        std::fread(&header, sizeof(header), 1, fFile) != 1 || std::memcmp(header.magic, kChunkMagic, sizeof(kChunkMagic)) != 0)
+        throw std::runtime_error("Step file: corrupt chunk header.");
+
+    fChunkSteps.clear();
+    fChunkSteps.setFloat32(isFloat32());
+    std::vector<unsigned char> blob;
+    for (int s = 0; s < StepFile::kNumSections; ++s) {
+        blob.resize(header.compressedSize[s]);
+        if (!blob.empty() && std::fread(blob.data(), 1, blob.size(), fFile) != blob.size())
+            throw std::runtime_error("Step file: truncated chunk.");
+        if (s == StepFile::EVENT_IDS)
+            decodeSection(blob, header.rawSize[s], fChunkEventIds);
+        else if (s == StepFile::EVENT_OFFSETS)
+            decodeSection(blob, header.rawSize[s], fChunkOffsets);
+        else if (s == StepFile::TRACK_IDS)
+            decodeSection(blob, header.rawSize[s], fChunkSteps.trackIds());
+        else if (s == StepFile::TRACK_STARTS)
+            decodeSection(blob, header.rawSize[s], fChunkSteps.trackStarts());
+        else if (isFloat32())
+            decodeSection(blob, header.rawSize[s], fChunkSteps.floatColumn(s - StepFile::VALUES_BEGIN));
+        else
+            decodeSection(blob, header.rawSize[s], fChunkSteps.doubleColumn(s - StepFile::VALUES_BEGIN));
+    }
+    fCachedChunk = static_cast<long>(chunk);
+}
+
+void StepFileReader::readEvents(size_t begin, size_t end, RunRecords& out, std::vector<long>& eventIds) {
+    end = std::min(end, fNumEvents);
+    out.clear();
+    out.setFloat32(isFloat32());
+    out.offsets.assign(1, 0);
+    eventIds.clear();
+
+    // First chunk whose events reach past begin
+    size_t chunk = std::upper_bound(fIndex.begin(), fIndex.end(), static_cast<uint64_t>(begin),
+                                    [](uint64_t event, const StepFile::IndexEntry& entry) { return event < entry.firstEvent; }) -
+                   fIndex.begin();
+    chunk = chunk > 0 ? chunk - 1 : 0;
+    for (size_t event = begin; event < end; ++chunk) {
+        loadChunk(chunk);
+        const StepFile::IndexEntry& entry = fIndex[chunk];
+        size_t first = event - entry.firstEvent;
+        size_t last = std::min<size_t>(end - entry.firstEvent, entry.numEvents);
+        size_t stepBegin = fChunkOffsets[first], stepEnd = fChunkOffsets[last];
+
+        long shift = static_cast<long>(out.size()) - static_cast<long>(stepBegin);
+        for (int c = 0; c < StepArena::kNumColumns; ++c) {
+            if (isFloat32())
+                out.floatColumn(c).insert(out.floatColumn(c).end(), fChunkSteps.floatColumn(c).begin() + stepBegin,
+                                          fChunkSteps.floatColumn(c).begin() + stepEnd);
+            else
+                out.doubleColumn(c).insert(out.doubleColumn(c).end(), fChunkSteps.doubleColumn(c).begin() + stepBegin,
+                                           fChunkSteps.doubleColumn(c).begin() + stepEnd);
+        }
+        out.trackIds().insert(out.trackIds().end(), fChunkSteps.trackIds().begin() + stepBegin,
+                              fChunkSteps.trackIds().begin() + stepEnd);
+        const std::vector<long>& starts = fChunkSteps.trackStarts();
+        for (auto it = std::lower_bound(starts.begin(), starts.end(), static_cast<long>(stepBegin));
+             it != starts.end() && *it < static_cast<long>(stepEnd); ++it) {
+            out.trackStarts().push_back(*it + shift);
+        }
+        for (size_t idx = first; idx < last; ++idx) {
+            out.offsets.push_back(fChunkOffsets[idx + 1] + shift);
+            eventIds.push_back(fChunkEventIds[idx]);
+        }
+        event = entry.firstEvent + last;
+    }
+}
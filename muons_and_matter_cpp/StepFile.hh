@@ -0,0 +1,137 @@
+#ifndef STEPFILE_HH
+#define STEPFILE_HH
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CustomEventAction.hh"
+#include "StepArena.hh"
+
+// Chunked columnar step file. Events are grouped into chunks of roughly chunkSteps steps; every chunk stores the
+// event ids, the per-event step offsets and each step column as its own zlib stream. An index of the chunks at
+// the end of the file gives random access to any event.
+//
+// File:  FileHeader, chunks..., index (one IndexEntry per chunk), Trailer
+// Chunk: ChunkHeader, then the kNumSections sections in Section order, each compressedSize bytes
+//        (stored raw when compressedSize == rawSize)
+namespace StepFile {
+    enum Section { EVENT_IDS, EVENT_OFFSETS, VALUES_BEGIN, TRACK_IDS = VALUES_BEGIN + StepArena::kNumColumns, TRACK_STARTS,
+                   kNumSections };
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t float32;
+        uint32_t numValueColumns;
+        uint32_t reserved;
+    };
+
+    struct ChunkHeader {
+        char magic[4];
+        uint32_t numEvents;
+        uint64_t numSteps;
+        uint64_t numTrackStarts;
+        uint64_t compressedSize[kNumSections];
+        uint64_t rawSize[kNumSections];
+    };
+
+    struct IndexEntry {
+        uint64_t fileOffset;
+        uint64_t firstEvent; // Position of the chunk's first event in the file, not its event id
+        uint64_t numEvents;
+    };
+
+    struct Trailer {
+        uint64_t indexOffset;
+        uint64_t numChunks;
+        uint64_t numEvents;
+        char magic[8];
+    };
+}
+
+// Appends events to a step file. appendEvent() only copies the steps into the open chunk (thread-safe, callable
+// from every worker's event action); full chunks are compressed and written by a background thread, so the
+// transport loop never waits for compression or disk unless maxPendingChunks chunks are already queued.
+class StepFileWriter {
+public:
+    // compressionLevel 0 stores the sections raw
+    StepFileWriter(const std::string& path, bool float32, size_t chunkSteps = 1 << 20, int compressionLevel = 1,
+                   size_t maxPendingChunks = 8);
+    ~StepFileWriter();
+
+    void appendEvent(long eventID, const StepArena& steps);
+    // Writes the open chunk, waits for the background thread and writes the index. Idempotent.
+    void close();
+
+    unsigned long long getEventsWritten() const;
+    unsigned long long getBytesWritten() const;
+
+private:
+    struct Chunk {
+        std::vector<long> eventIds;
+        std::vector<long> offsets;
+        RunRecords steps;
+    };
+
+    std::string fPath;
+    bool fFloat32;
+    size_t fChunkSteps;
+    int fCompressionLevel;
+    size_t fMaxPendingChunks;
+    FILE* fFile;
+
+    std::mutex fMutex;
+    std::condition_variable fQueueChanged;
+    std::unique_ptr<Chunk> fOpenChunk;
+    StepArena fConverted;
+    std::deque<std::unique_ptr<Chunk>> fPending;
+    // Full chunks taken by appendEvent() calls that wait for room in fPending
+    size_t fHeldChunks;
+    bool fClosing;
+    bool fClosed;
+    std::string fError;
+    std::thread fThread;
+
+    // Touched by the background thread only until it is joined
+    std::vector<StepFile::IndexEntry> fIndex;
+    unsigned long long fEventsWritten;
+    unsigned long long fBytesWritten;
+
+    void run();
+    void writeChunk(const Chunk& chunk);
+    void writeBytes(const void* data, size_t size);
+};
+
+// Random access reader for step files
+class StepFileReader {
+public:
+    explicit StepFileReader(const std::string& path);
+    ~StepFileReader();
+
+    size_t getNumEvents() const { return fNumEvents; }
+    bool isFloat32() const { return fHeader.float32 != 0; }
+    // Events [begin, end) in file order into out (offsets relative to out), with their event ids
+    void readEvents(size_t begin, size_t end, RunRecords& out, std::vector<long>& eventIds);
+
+private:
+    FILE* fFile;
+    StepFile::FileHeader fHeader;
+    std::vector<StepFile::IndexEntry> fIndex;
+    size_t fNumEvents;
+
+    // Last decoded chunk
+    long fCachedChunk;
+    std::vector<long> fChunkEventIds;
+    std::vector<long> fChunkOffsets;
+    RunRecords fChunkSteps;
+
+    void loadChunk(size_t chunk);
+};
+
+#endif
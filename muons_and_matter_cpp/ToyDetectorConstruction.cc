@@ -18,6 +18,7 @@
 #include "CustomMagneticField.hh"
 #include "G4SDManager.hh"
 #include <iostream>
+#include <stdexcept>
 
 // Define the EasyMagneticField class directly in this file
 class EasyMagneticField : public G4MagneticField {
@@ -86,42 +87,151 @@ G4VPhysicalVolume *ToyDetectorConstruction::Construct() {
     Json::Value field_value = detectorData["global_field_map"];
 
     G4MagneticField* GlobalmagField = nullptr;
-    if (!B_vector.empty()) {
-        if (B_vector.size() == 3) {
+    if (!fieldMap.empty()) {
+        if (fieldMap.size == 3) {
             std::cout << "Using uniform magnetic field.\n";
-            GlobalmagField = new G4UniformMagField(G4ThreeVector(B_vector[0] * tesla, B_vector[1] * tesla, B_vector[2] * tesla));
+            GlobalmagField = new G4UniformMagField(G4ThreeVector(fieldMap[0] * tesla, fieldMap[1] * tesla, fieldMap[2] * tesla));
         } else {
             std::cout << "Using CustomMagneticField.\n";
             std::map<std::string, std::vector<double>> ranges;
-            std::vector<G4ThreeVector> fields;
             ranges["range_x"] = {detectorData["global_field_map"]["range_x"][0].asDouble() * m, detectorData["global_field_map"]["range_x"][1].asDouble() * m, detectorData["global_field_map"]["range_x"][2].asDouble() * m};
             ranges["range_y"] = {detectorData["global_field_map"]["range_y"][0].asDouble() * m, detectorData["global_field_map"]["range_y"][1].asDouble() * m, detectorData["global_field_map"]["range_y"][2].asDouble() * m};
             ranges["range_z"] = {detectorData["global_field_map"]["range_z"][0].asDouble() * m, detectorData["global_field_map"]["range_z"][1].asDouble() * m, detectorData["global_field_map"]["range_z"][2].asDouble() * m};
-            for (size_t i = 0; i < B_vector.size(); i += 3) {
-                fields.emplace_back(B_vector[i] * tesla, B_vector[i + 1] * tesla, B_vector[i + 2] * tesla);
-            }
             CustomMagneticField::InterpolationType interpType = CustomMagneticField::NEAREST_NEIGHBOR;
-            GlobalmagField = new CustomMagneticField(ranges, fields, interpType);
+            std::string interpolation = field_value.get("interpolation", "nearest").asString();
+            if (interpolation == "linear") {
+                interpType = CustomMagneticField::LINEAR;
+            } else if (interpolation == "cubic") {
+                interpType = CustomMagneticField::CUBIC;
+            } else if (interpolation != "nearest") {
+                throw std::runtime_error("Unknown field map interpolation: " + interpolation);
+            }
+            std::cout << "Field map interpolation: " << interpolation << "\n";
+            CustomMagneticField::StorageType storageType = CustomMagneticField::FLOAT32_SOA;
+            std::string storage = field_value.get("storage", "soa").asString();
+            if (storage == "bricks") {
+                storageType = CustomMagneticField::FLOAT32_BRICKS;
+            } else if (storage == "external") {
+                storageType = CustomMagneticField::EXTERNAL;
+            } else if (storage != "soa") {
+                throw std::runtime_error("Unknown field map storage: " + storage);
+            }
+            CustomMagneticField::SymmetryType symmetryType = CustomMagneticField::QUADRANT;
+            std::string symmetry = field_value.get("symmetry", "quadrant").asString();
+            if (symmetry == "none") {
+                symmetryType = CustomMagneticField::NO_SYMMETRY;
+            } else if (symmetry == "x") {
+                symmetryType = CustomMagneticField::X_MIRROR;
+            } else if (symmetry == "octant") {
+                symmetryType = CustomMagneticField::OCTANT;
+            } else if (symmetry != "quadrant") {
+                throw std::runtime_error("Unknown field map symmetry: " + symmetry);
+            }
+            std::cout << "Field map symmetry: " << symmetry << "\n";
+            double sparseThreshold = field_value.get("sparse_threshold", 0.0).asDouble();
+            customField = new CustomMagneticField(ranges, fieldMap, interpType, storageType, sparseThreshold, symmetryType);
+            customField->setLookupCache(field_value.get("lookup_cache", true).asBool());
+            GlobalmagField = customField;
         }
     } else {
         std::cout << "No magnetic field vector provided, using EasyMagneticField.\n";
         GlobalmagField = new EasyMagneticField();
     }
 
+    globalField = GlobalmagField;
+    worldLogicalVolume = logicWorld;
+
+    filmLogicalVolume = nullptr;
+    if (detectorData.isMember("sensitive_film")) {
+        const Json::Value& film = detectorData["sensitive_film"];
+        G4double filmSizeX = film.get("dx", detectorData["worldSizeX"].asDouble()).asDouble() * m;
+        G4double filmSizeY = film.get("dy", detectorData["worldSizeY"].asDouble()).asDouble() * m;
+        G4double filmSizeZ = film.get("dz", 0.001).asDouble() * m;
+        G4double filmZ = film["z_center"].asDouble() * m;
+        G4Material* filmMaterial = nist->FindOrBuildMaterial(film.get("material", "G4_Galactic").asString());
+
+        G4Box* solidFilm = new G4Box("SlimFilm", filmSizeX / 2, filmSizeY / 2, filmSizeZ / 2);
+        filmLogicalVolume = new G4LogicalVolume(solidFilm, filmMaterial, "SlimFilmLogical");
+        new G4PVPlacement(0, G4ThreeVector(0, 0, filmZ), filmLogicalVolume, "SlimFilmPhysical", logicWorld, false, 0, true);
+        std::cout << "Sensitive film at z = " << filmZ / m << " m, thickness " << filmSizeZ / mm << " mm\n";
+    }
+
+    return physWorld;
+}
+
+void ToyDetectorConstruction::ConstructSDandField() {
+    // The field is shared read-only, the field manager and its chord finder belong to this thread
     auto fieldManager = new G4FieldManager();
-    fieldManager->SetDetectorField(GlobalmagField);
-    fieldManager->CreateChordFinder(GlobalmagField);
-    logicWorld->SetFieldManager(fieldManager, true);
+    fieldManager->SetDetectorField(globalField);
+    fieldManager->CreateChordFinder(globalField);
+    worldLogicalVolume->SetFieldManager(fieldManager, true);
+    {
+        std::lock_guard<std::mutex> lock(filmsMutex);
+        fieldManagers.push_back(fieldManager);
+    }
     std::cout << "Field set...\n";
 
-    return physWorld;
+    if (filmLogicalVolume != nullptr) {
+        // A reconfigured session finds the film of the previous detector already registered with this thread.
+        // Its buffers are left as they are: hits not collected before reconfigure() come with the next collection.
+        auto film = dynamic_cast<SlimFilmSensitiveDetector*>(
+                G4SDManager::GetSDMpointer()->FindSensitiveDetector("SlimFilm", false));
+        if (film == nullptr) {
+            film = new SlimFilmSensitiveDetector("SlimFilm");
+            G4SDManager::GetSDMpointer()->AddNewDetector(film);
+        }
+        SetSensitiveDetector(filmLogicalVolume, film);
+        std::lock_guard<std::mutex> lock(filmsMutex);
+        films.push_back(film);
+    }
+}
+
+bool ToyDetectorConstruction::hasSensitiveFilm() const {
+    return filmLogicalVolume != nullptr;
+}
+
+void ToyDetectorConstruction::collectFilmHits(StepArena& out, std::vector<int>& pdgIds, std::vector<int>& eventIds) {
+    std::lock_guard<std::mutex> lock(filmsMutex);
+    if (films.size() == 1) {
+        // Copied out rather than moved, so the film keeps its buffers' capacity for the next run
+        out.assign(films[0]->hits);
+        pdgIds.assign(films[0]->pdgIds.begin(), films[0]->pdgIds.end());
+        eventIds.assign(films[0]->eventIds.begin(), films[0]->eventIds.end());
+        films[0]->clear();
+        return;
+    }
+    out.clear();
+    pdgIds.clear();
+    eventIds.clear();
+    for (SlimFilmSensitiveDetector* film : films) {
+        out.append(film->hits);
+        pdgIds.insert(pdgIds.end(), film->pdgIds.begin(), film->pdgIds.end());
+        eventIds.insert(eventIds.end(), film->eventIds.begin(), film->eventIds.end());
+        film->clear();
+    }
 }
 
-ToyDetectorConstruction::ToyDetectorConstruction(Json::Value detector_data, const std::vector<double>& B_vector)
-    : detectorData(detector_data), B_vector(B_vector) {
+ToyDetectorConstruction::ToyDetectorConstruction(Json::Value detector_data, const FieldMapBuffer& field_map)
+    : detectorData(detector_data), fieldMap(field_map), customField(nullptr), globalField(nullptr),
+      filmLogicalVolume(nullptr) {
     detectorWeightTotal = 0;
 }
 
+ToyDetectorConstruction::~ToyDetectorConstruction() {
+    // The geometry this detector built is gone, and with it the volumes using these
+    for (G4FieldManager* fieldManager : fieldManagers) {
+        delete fieldManager;
+    }
+    delete globalField;
+}
+
 void ToyDetectorConstruction::setMagneticFieldValue(double strength, double theta, double phi) {
     std::cout << "cannot set magnetic field value for boxy detector.\n" << std::endl;
 }
+
+CustomMagneticField* ToyDetectorConstruction::getCustomField() const {
+    return customField;
+}
+G4MagneticField* ToyDetectorConstruction::getMagneticField() {
+    return globalField;
+}
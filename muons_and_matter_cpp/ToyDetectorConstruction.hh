@@ -7,20 +7,48 @@
 
 #include "DetectorConstruction.hh"
 #include "json/json.h"
+#include "CustomMagneticField.hh"
+#include "SlimFilmSensitiveDetector.hh"
+#include <mutex>
+#include <vector>
+
+class G4FieldManager;
 
 class ToyDetectorConstruction : public DetectorConstruction {
 public:
     virtual G4VPhysicalVolume *Construct();
+    virtual void ConstructSDandField();
 public:
-    ToyDetectorConstruction(Json::Value detector_data, const std::vector<double>& B_vector);
+    ToyDetectorConstruction(Json::Value detector_data, const FieldMapBuffer& field_map);
+    ~ToyDetectorConstruction() override;
 protected:
     Json::Value detectorData;
-    std::vector<double> B_vector;
+    FieldMapBuffer fieldMap;
+    CustomMagneticField* customField;
+    G4MagneticField* globalField;
 
 protected:
     double detectorWeightTotal;
 public:
     void setMagneticFieldValue(double strength, double theta, double phi) override;
+    G4MagneticField* getMagneticField() override;
+    // Null unless the field map is a CustomMagneticField
+    CustomMagneticField* getCustomField() const;
+
+    // True if the configuration places a "sensitive_film"
+    bool hasSensitiveFilm() const;
+    // Copies the hits of the films of all threads into out, pdgIds and eventIds, and empties the films; they
+    // keep their buffers' capacity for the next run
+    void collectFilmHits(StepArena& out, std::vector<int>& pdgIds, std::vector<int>& eventIds);
+
+protected:
+    G4LogicalVolume* filmLogicalVolume;
+    // Films of all threads built so far, owned by the SD manager. The mutex also guards fieldManagers.
+    std::mutex filmsMutex;
+    std::vector<SlimFilmSensitiveDetector*> films;
+    // Field managers (with their chord finders) built by ConstructSDandField on every thread, deleted with
+    // the detector
+    std::vector<G4FieldManager*> fieldManagers;
 
 };
 
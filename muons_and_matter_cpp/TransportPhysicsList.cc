@@ -0,0 +1,70 @@
+#include "TransportPhysicsList.hh"
+#include "G4MuonPlus.hh"
+#include "G4MuonMinus.hh"
+#include "G4Geantino.hh"
+#include "G4ChargedGeantino.hh"
+#include "G4Electron.hh"
+#include "G4Positron.hh"
+#include "G4Gamma.hh"
+#include "G4PhysicsListHelper.hh"
+#include "G4MuMultipleScattering.hh"
+#include "G4MuIonisation.hh"
+#include "G4MuBremsstrahlung.hh"
+#include "G4MuPairProduction.hh"
+#include "G4eMultipleScattering.hh"
+#include "G4eIonisation.hh"
+#include "G4eBremsstrahlung.hh"
+#include "G4eplusAnnihilation.hh"
+#include "G4PhotoElectricEffect.hh"
+#include "G4ComptonScattering.hh"
+#include "G4GammaConversion.hh"
+
+TransportPhysicsList::TransportPhysicsList(bool muonEm) : G4VModularPhysicsList(), fMuonEm(muonEm) {
+}
+
+TransportPhysicsList::~TransportPhysicsList() {
+}
+
+void TransportPhysicsList::ConstructParticle() {
+    G4MuonPlus::MuonPlusDefinition();
+    G4MuonMinus::MuonMinusDefinition();
+    G4Geantino::GeantinoDefinition();
+    G4ChargedGeantino::ChargedGeantinoDefinition();
+    if (fMuonEm) {
+        G4Electron::ElectronDefinition();
+        G4Positron::PositronDefinition();
+        G4Gamma::GammaDefinition();
+    }
+    G4VModularPhysicsList::ConstructParticle();
+}
+
+void TransportPhysicsList::ConstructProcess() {
+    // Transportation for every particle, then whatever constructors are registered
+    G4VModularPhysicsList::ConstructProcess();
+    if (!fMuonEm) {
+        return;
+    }
+
+    G4PhysicsListHelper* helper = G4PhysicsListHelper::GetPhysicsListHelper();
+    for (G4ParticleDefinition* muon : {static_cast<G4ParticleDefinition*>(G4MuonPlus::MuonPlus()),
+                                       static_cast<G4ParticleDefinition*>(G4MuonMinus::MuonMinus())}) {
+        helper->RegisterProcess(new G4MuMultipleScattering(), muon);
+        helper->RegisterProcess(new G4MuIonisation(), muon);
+        helper->RegisterProcess(new G4MuBremsstrahlung(), muon);
+        helper->RegisterProcess(new G4MuPairProduction(), muon);
+    }
+
+    // The standard processes for the muons' secondaries, which otherwise cross matter without losing energy
+    // and curl in the field until the looper killer stops them
+    for (G4ParticleDefinition* lepton : {static_cast<G4ParticleDefinition*>(G4Electron::Electron()),
+                                         static_cast<G4ParticleDefinition*>(G4Positron::Positron())}) {
+        helper->RegisterProcess(new G4eMultipleScattering(), lepton);
+        helper->RegisterProcess(new G4eIonisation(), lepton);
+        helper->RegisterProcess(new G4eBremsstrahlung(), lepton);
+    }
+    helper->RegisterProcess(new G4eplusAnnihilation(), G4Positron::Positron());
+    G4ParticleDefinition* gamma = G4Gamma::Gamma();
+    helper->RegisterProcess(new G4PhotoElectricEffect(), gamma);
+    helper->RegisterProcess(new G4ComptonScattering(), gamma);
+    helper->RegisterProcess(new G4GammaConversion(), gamma);
+}
@@ -0,0 +1,23 @@
+#ifndef TRANSPORTPHYSICSLIST_HH
+#define TRANSPORTPHYSICSLIST_HH
+
+#include "G4VModularPhysicsList.hh"
+
+// Lightweight physics for vacuum and field-only worlds: muons (and geantinos) with transportation only, so
+// nothing but the field bends them. With muonEm the muons also get multiple scattering, ionisation,
+// bremsstrahlung and pair production, and their electron, positron and photon secondaries the standard
+// electromagnetic processes.
+// Constructors such as G4StepLimiterPhysics can be registered on top as usual.
+class TransportPhysicsList : public G4VModularPhysicsList {
+public:
+    explicit TransportPhysicsList(bool muonEm);
+    ~TransportPhysicsList() override;
+
+    void ConstructParticle() override;
+    void ConstructProcess() override;
+
+private:
+    bool fMuonEm;
+};
+
+#endif
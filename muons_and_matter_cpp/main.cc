@@ -1,4 +1,5 @@
 #include "G4RunManager.hh"
+#include "G4RunManagerFactory.hh"
 #include "G4UImanager.hh"
 #include "QBBC.hh"
 #include "G4UImanager.hh"
@@ -12,6 +13,8 @@
 #include "DetectorConstruction.hh"
 #include "PrimaryGeneratorAction.hh"
 #include "CustomSteppingAction.hh"
+#include "ActionInitialization.hh"
+#include "StepFile.hh"
 
 #include "G4PhysicsListHelper.hh"
 #include "G4StepLimiterPhysics.hh"
@@ -19,6 +22,7 @@
 #include "G4PhysListFactory.hh"
 #include "G4ParticleTypes.hh"
 #include "ToyDetectorConstruction.hh"
+#include "TransportPhysicsList.hh"
 
 
 
@@ -60,8 +64,9 @@ int main(int argc, char** argv)
         ui = new G4UIExecutive(argc, argv);
     }
 
-    // Construct the default run manager
-    G4RunManager* runManager = new G4RunManager;
+    // Construct the default run manager: tasking if Geant4 was built with multithreading, the thread
+    // count comes from G4FORCENUMBEROFTHREADS or /run/numberOfThreads in the macro
+    G4RunManager* runManager = G4RunManagerFactory::CreateRunManager(G4RunManagerType::Default);
 
 //    std::ifstream inputFile("../../data/boxy.json");
     std::ifstream inputFile("../../data/gdetector.json");
@@ -91,28 +96,49 @@ int main(int argc, char** argv)
         std::cerr << "Failed to parse JSON: " << errs << std::endl;
     }
 
-    std::vector<double> B_vector;
+    // No field map given, the toy detector falls back to its built-in field
+    FieldMapBuffer B_map;
 
 
     // Set mandatory initialization classes
-    runManager->SetUserInitialization(new GDetectorConstruction(fileContents, B_vector));
+    runManager->SetUserInitialization(new ToyDetectorConstruction(detectorData, B_map));
 //    runManager->SetUserInitialization(new BoxyDetectorConstruction(fileContents));
 //    runManager->SetUserInitialization(new DetectorConstruction);
 
 
-    // Use the QGSP_BERT physics list
-    G4VModularPhysicsList* physicsList = new QGSP_BERT;
+    // Use the QGSP_BERT physics list, or transportation only for vacuum and field worlds
+    G4VModularPhysicsList* physicsList = nullptr;
+    std::string physicsMode = detectorData.get("physics_mode", "full").asString();
+    if (physicsMode == "full") {
+        physicsList = new QGSP_BERT;
+    } else if (physicsMode == "transport") {
+        physicsList = new TransportPhysicsList(detectorData.get("muon_em", false).asBool());
+    } else {
+        std::cerr << "Unknown physics mode: " << physicsMode << std::endl;
+        return 1;
+    }
 //    physicsList->RegisterPhysics(new G4EmLivermorePhysics());
 //    physicsList->RegisterPhysics(new G4StepLimiterPhysics());
     runManager->SetUserInitialization(physicsList);
 
-    PrimaryGeneratorAction *primaryGeneratorAction = new PrimaryGeneratorAction();
-    CustomSteppingAction *customSteppingAction = new CustomSteppingAction();
-    primaryGeneratorAction->setSteppingAction(customSteppingAction);
-
-    // Set user action classes
-    runManager->SetUserAction(primaryGeneratorAction);
-    runManager->SetUserAction(customSteppingAction);
+    // Set user action classes, built once per worker thread
+    auto actionInitialization = new ActionInitialization(false, true);
+    std::vector<double> scoringPlanes;
+    for (const Json::Value& z : detectorData["scoring_planes"]) {
+        scoringPlanes.push_back(z.asDouble());
+    }
+    actionInitialization->setScoringPlanes(scoringPlanes);
+    actionInitialization->setKillRegions(KillRegions(detectorData["kill_regions"]));
+    runManager->SetUserInitialization(actionInitialization);
+
+    // Optionally stream the steps of every event of the macro's runs to a step file
+    std::unique_ptr<StepFileWriter> outputWriter;
+    if (detectorData.isMember("output_file")) {
+        outputWriter.reset(new StepFileWriter(detectorData["output_file"].asString(), false,
+                                              detectorData.get("output_chunk_steps", 1 << 20).asUInt(),
+                                              detectorData.get("output_compression_level", 1).asInt()));
+        actionInitialization->setOutputWriter(outputWriter.get());
+    }
 
     // Initialize visualization
     G4VisManager* visManager = new G4VisExecutive;
@@ -136,6 +162,10 @@ int main(int argc, char** argv)
     }
 
     // Job termination
+    if (outputWriter) {
+        actionInitialization->setOutputWriter(nullptr);
+        outputWriter->close();
+    }
     delete visManager;
     delete runManager;
     return 0;
@@ -8,7 +8,7 @@ e_charge = 1.602176634e-19  # Elementary charge in Coulombs
 GeV_over_c_to_SI = 1.602176634e-10 / c  # ≈ 5.3443e-19 kg·m/s
 
 
-from mag_fields import ToyMagneticField, UniformMagneticField, CustomMagneticField
+from mag_fields import ToyMagneticField, UniformMagneticField, CustomMagneticField, Geant4MagneticField
     
 def rk4_step(x: float, y: float, z: float, 
              px: float, py: float, pz: float, 
@@ -93,6 +93,8 @@ def track_particle(x: float, y: float, z: float,
         mag_field_generator = ToyMagneticField()
     elif mag_field == 'uniform':
         mag_field_generator = UniformMagneticField()
+    elif mag_field == 'geant4':
+        mag_field_generator = Geant4MagneticField()
     else:
         mag_field_generator = CustomMagneticField(mag_field)
     for _ in range(num_steps):
@@ -113,3 +115,26 @@ def track_particle(x: float, y: float, z: float,
     
     return trajectory
 
+
+def track_particles_native(muons, num_steps: int, step_length: float = 0.05,
+                           adaptive: bool = False, z_stop: float = 100.0, num_threads: int = 0):
+    """
+    Tracks many particles through the Geant4 transport field with the multithreaded C++ RK4 tracker.
+    Call geant4.initialize_geant4 first.
+
+    Args:
+        muons: (N, 7) array of x, y, z (m), px, py, pz (GeV/c), charge
+        num_steps: Maximum number of steps per particle
+        step_length: Step size in meters, the first step if adaptive
+        adaptive: Use step doubling error control instead of a fixed step
+        z_stop: Stop a particle once it passes this z (meters)
+
+    Returns:
+        List of (K, 6) arrays of x, y, z, px, py, pz, one per particle
+    """
+    from muon_slabs import track_in_field
+    result = track_in_field(np.asarray(muons, dtype=np.float64), step_length=step_length, max_steps=num_steps,
+                            adaptive=adaptive, z_stop=z_stop, store_trajectories=True, num_threads=num_threads)
+    points = np.stack([result['x'], result['y'], result['z'], result['px'], result['py'], result['pz']], axis=1)
+    offsets = result['offsets']
+    return [points[offsets[i]:offsets[i + 1]] for i in range(len(offsets) - 1)]